@@ -0,0 +1,50 @@
+#!/bin/sh
+# Glob expansion benchmark: times patterns over a directory with many entries
+# in wsh and in /bin/sh. Each pattern is expanded REPS times as the argument of
+# true; the cost of running true itself is measured separately and subtracted.
+#
+# Usage: bench/glob.sh [WSH] [ENTRIES]
+
+WSH=${1:-./wsh}
+ENTRIES=${2:-150000}
+REPS=${REPS:-20}
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+export WSH_HISTFILE="$DIR/history"
+
+mkdir "$DIR/files"
+seq 1 "$ENTRIES" | sed "s|.*|$DIR/files/f&.log|" | xargs touch
+seq 1 1000 | sed "s|.*|$DIR/files/t&.txt|" | xargs touch
+
+now_ms() {
+    echo $(($(date +%s%N) / 1000000))
+}
+
+# Run REPS lines of "true WORD" in a shell, print elapsed ms
+run() {
+    shell=$1
+    word=$2
+    script="$DIR/script"
+    : > "$script"
+    i=0
+    while [ $i -lt "$REPS" ]; do
+        echo "true $word" >> "$script"
+        i=$((i + 1))
+    done
+    echo "exit" >> "$script"
+    start=$(now_ms)
+    $shell < "$script" > /dev/null 2>&1
+    echo $(($(now_ms) - start))
+}
+
+echo "$ENTRIES entries, $REPS expansions per pattern, ms per expansion"
+printf '%-24s %10s %10s\n' pattern wsh sh
+base_wsh=$(run "$WSH" plain)
+base_sh=$(run /bin/sh plain)
+for pattern in '*.nomatch' '*7.log' 'f1????.log' 't*.txt' '*[05].txt'; do
+    w=$(run "$WSH" "$DIR/files/$pattern")
+    s=$(run /bin/sh "$DIR/files/$pattern")
+    awk -v p="$pattern" -v w="$w" -v bw="$base_wsh" -v s="$s" -v bs="$base_sh" -v n="$REPS" \
+        'BEGIN { printf "%-24s %10.2f %10.2f\n", p, (w - bw) / n, (s - bs) / n }'
+done
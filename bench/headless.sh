@@ -0,0 +1,46 @@
+#!/bin/sh
+# Headless mode benchmark: runs a script of N simple commands through wsh in
+# the interactive profile (-i) and the headless one, and reports the system
+# calls made per command by the shell and by its children before they exec,
+# plus the wall time per command.
+#
+# Usage: bench/headless.sh [WSH] [SYSCOUNT] [N]
+
+WSH=${1:-./wsh}
+SYSCOUNT=${2:-./bench/syscount}
+N=${3:-2000}
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+export WSH_HISTFILE="$DIR/history"
+
+script="$DIR/script"
+seq 1 "$N" | sed 's|.*|/bin/true|' > "$script"
+
+now_us() {
+    echo $(($(date +%s%N) / 1000))
+}
+
+# Print "shell-calls child-calls us-per-command" for one profile
+run() {
+    counts=$("$SYSCOUNT" "$WSH" "$@" < "$script" 2>/dev/null | tail -n 1 | sed 's/.*wsh> //')
+    start=$(now_us)
+    "$WSH" "$@" < "$script" > /dev/null 2>&1
+    elapsed=$(($(now_us) - start))
+    echo "$counts $elapsed"
+}
+
+report() {
+    echo "$2" | awk -v name="$1" -v n="$N" \
+        '{ printf "%-12s %8.2f %8.2f %10.1f\n", name, $1 / n, $2 / n, $3 / n }'
+}
+
+interactive=$(run -i)
+headless=$(run --headless)
+
+echo "$N commands"
+printf "%-12s %8s %8s %10s\n" "profile" "shell" "child" "us/cmd"
+report interactive "$interactive"
+report headless "$headless"
+echo "$interactive $headless" | awk -v n="$N" \
+    '{ printf "saved per command: %.2f shell + %.2f child syscalls\n", ($1 - $4) / n, ($2 - $5) / n }'
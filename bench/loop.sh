@@ -0,0 +1,33 @@
+#!/bin/sh
+# Loop benchmark: N iterations of a built-in body as a for loop and as the
+# equivalent unrolled script, one line per iteration, in wsh and /bin/sh.
+#
+# Usage: bench/loop.sh [WSH] [N]
+
+WSH=${1:-./wsh}
+N=${2:-100000}
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+export WSH_HISTFILE="$DIR/history"
+
+seq 1 "$N" > "$DIR/items"
+echo "for i in \$(cat $DIR/items); do x=\$i; true \$x; done" > "$DIR/loop"
+sed 's/.*/x=&; true $x/' "$DIR/items" > "$DIR/unrolled"
+
+now_ms() {
+    echo $(($(date +%s%N) / 1000000))
+}
+
+# Run a script in a shell, print elapsed ms
+run() {
+    start=$(now_ms)
+    $1 < "$2" > /dev/null 2>&1
+    echo $(($(now_ms) - start))
+}
+
+echo "$N iterations of x=\$i; true \$x"
+printf "%-10s %10s %10s\n" "shell" "loop ms" "unrolled ms"
+for shell in "$WSH" /bin/sh; do
+    printf "%-10s %10s %10s\n" "$(basename "$shell")" "$(run "$shell" "$DIR/loop")" "$(run "$shell" "$DIR/unrolled")"
+done
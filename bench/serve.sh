@@ -0,0 +1,31 @@
+#!/bin/sh
+# Server mode benchmark: requests per second and latency of command lines sent
+# to one wsh --serve by several clients, for a built-in and for an external
+# command. Starting a wsh -c per command (bench/startup) is the baseline.
+#
+# Usage: bench/serve.sh [WSH] [SERVELOAD] [CLIENTS] [N]
+
+WSH=${1:-./wsh}
+SERVELOAD=${2:-./bench/serveload}
+CLIENTS=${3:-8}
+N=${4:-20000}
+
+DIR=$(mktemp -d)
+sock="$DIR/sock"
+export WSH_HISTFILE="$DIR/history"
+
+"$WSH" --serve "$sock" &
+server=$!
+trap 'kill $server 2>/dev/null; wait $server; rm -rf "$DIR"' EXIT
+
+# Wait for the server to listen
+tries=0
+while [ ! -S "$sock" ] && [ $tries -lt 100 ]; do
+    sleep 0.01
+    tries=$((tries + 1))
+done
+
+for cmd in true /bin/true; do
+    "$SERVELOAD" "$sock" "$CLIENTS" "$N" "$cmd"
+    echo
+done
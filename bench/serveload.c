@@ -0,0 +1,145 @@
+// Load test for wsh --serve: CLIENTS connections each send their share of N
+// requests back to back, with /dev/null as stdio, and wait for every exit
+// status. Prints requests per second and latency percentiles.
+//
+// Usage: serveload SOCKET CLIENTS N COMMAND
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static struct sockaddr_un addr = { .sun_family = AF_UNIX };
+static const char *command;
+static int devnull;
+
+typedef struct {
+    int n; // Requests to send
+    double *times; // Latency of each, in us
+    int failed; // Requests answered with a nonzero status or not at all
+} client;
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Send one command line with stdio attached and wait for its exit status.
+// Returns -1 if the server went away
+static int request(int sock, int32_t *status) {
+    int fds[3] = { devnull, devnull, devnull };
+    union {
+        struct cmsghdr h;
+        char b[CMSG_SPACE(sizeof(fds))];
+    } ctl;
+    struct iovec iov = { (void *)command, strlen(command) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl.b, .msg_controllen = sizeof(ctl.b) };
+    struct cmsghdr *h = CMSG_FIRSTHDR(&msg);
+    h->cmsg_level = SOL_SOCKET;
+    h->cmsg_type = SCM_RIGHTS;
+    h->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(h), fds, sizeof(fds));
+
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) == -1) {
+        return -1;
+    }
+    if (recv(sock, status, sizeof(*status), 0) != sizeof(*status)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void *run_client(void *arg) {
+    client *c = arg;
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock == -1 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("connect");
+        c->failed = c->n;
+        c->n = 0;
+        return NULL;
+    }
+    for (int i = 0; i < c->n; i++) {
+        struct timespec t0, t1;
+        int32_t status;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        if (request(sock, &status) == -1) {
+            c->failed += c->n - i;
+            c->n = i;
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        c->times[i] = (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3;
+        c->failed += status != 0;
+    }
+    close(sock);
+
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 5 || atoi(argv[2]) <= 0 || atoi(argv[3]) <= 0 || strlen(argv[1]) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Usage: serveload SOCKET CLIENTS N COMMAND\n");
+        return 1;
+    }
+    strcpy(addr.sun_path, argv[1]);
+    int num_clients = atoi(argv[2]);
+    int n = atoi(argv[3]);
+    command = argv[4];
+    devnull = open("/dev/null", O_RDWR);
+    client *clients = calloc(num_clients, sizeof(client));
+    pthread_t *threads = calloc(num_clients, sizeof(pthread_t));
+    double *times = malloc(n * sizeof(double));
+    if (devnull == -1 || clients == NULL || threads == NULL || times == NULL) {
+        perror("serveload");
+        return 1;
+    }
+
+    // Each client records into its own stretch of times
+    double *next = times;
+    for (int i = 0; i < num_clients; i++) {
+        clients[i].n = n / num_clients + (i < n % num_clients);
+        clients[i].times = next;
+        next += clients[i].n;
+    }
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < num_clients; i++) {
+        pthread_create(&threads[i], NULL, run_client, &clients[i]);
+    }
+    for (int i = 0; i < num_clients; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    // Pack the completed requests together before sorting
+    int done = 0, failed = 0;
+    for (int i = 0; i < num_clients; i++) {
+        memmove(times + done, clients[i].times, clients[i].n * sizeof(double));
+        done += clients[i].n;
+        failed += clients[i].failed;
+    }
+    if (done == 0) {
+        printf("no requests completed\n");
+        return 1;
+    }
+    qsort(times, done, sizeof(double), cmp_double);
+
+    printf("%d clients, %d requests of '%s', %d failed\n", num_clients, done, command, failed);
+    printf("%10s %10s %10s %10s %10s\n", "req/s", "p50 us", "p99 us", "p99.9 us", "max us");
+    printf("%10.0f %10.1f %10.1f %10.1f %10.1f\n", done / elapsed, times[done / 2],
+        times[(int)(done * 0.99)], times[(int)(done * 0.999)], times[done - 1]);
+    free(times);
+    free(threads);
+    free(clients);
+
+    return failed != 0;
+}
@@ -0,0 +1,79 @@
+// Startup latency benchmark: runs SHELL -c COMMAND N times for each shell and
+// prints the median and 99th percentile wall time of a run.
+//
+// Usage: startup N COMMAND SHELL...
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Time one run in microseconds, or -1 if the shell couldn't be started
+static double run_once(const char *shell, const char *command, int devnull) {
+    struct timespec t0, t1;
+    int status;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pid_t pid = vfork();
+    if (pid == 0) {
+        dup2(devnull, STDOUT_FILENO);
+        execlp(shell, shell, "-c", command, (char *)NULL);
+        _exit(127);
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) == -1) {
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 127) {
+        return -1;
+    }
+
+    return (t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 4 || atoi(argv[1]) <= 0) {
+        fprintf(stderr, "Usage: startup N COMMAND SHELL...\n");
+        return 1;
+    }
+    int n = atoi(argv[1]);
+    const char *command = argv[2];
+    double *times = malloc(n * sizeof(double));
+    int devnull = open("/dev/null", O_WRONLY);
+    if (times == NULL || devnull == -1) {
+        perror("startup");
+        return 1;
+    }
+
+    printf("%d runs of -c '%s'\n", n, command);
+    printf("%-16s %10s %10s\n", "shell", "median us", "p99 us");
+    for (int s = 3; s < argc; s++) {
+        // A few untimed runs first so every shell starts from a warm page cache
+        int ok = 1;
+        for (int i = 0; i < 20 && ok; i++) {
+            ok = run_once(argv[s], command, devnull) >= 0;
+        }
+        for (int i = 0; i < n && ok; i++) {
+            ok = (times[i] = run_once(argv[s], command, devnull)) >= 0;
+        }
+        if (!ok) {
+            printf("%-16s %10s\n", argv[s], "not found");
+            continue;
+        }
+        qsort(times, n, sizeof(double), cmp_double);
+        int p99 = (int)(n * 0.99);
+        printf("%-16s %10.1f %10.1f\n", argv[s], times[n / 2], times[p99 < n ? p99 : n - 1]);
+    }
+    free(times);
+
+    return 0;
+}
@@ -0,0 +1,100 @@
+// Count the system calls made by a command and by every process it forks.
+// Prints two numbers: calls made by the top process, and calls made by its
+// descendants up to the point they exec something else.
+//
+// Usage: syscount COMMAND [ARGS...]
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+
+#define MAX_TRACED 4096
+
+// Processes being traced and whether they have exec'd since being forked
+static pid_t pids[MAX_TRACED];
+static int execd[MAX_TRACED];
+static int num_pids = 0;
+
+static int find(pid_t pid) {
+    for (int i = 0; i < num_pids; i++) {
+        if (pids[i] == pid) {
+            return i;
+        }
+    }
+    if (num_pids == MAX_TRACED) {
+        return -1;
+    }
+    pids[num_pids] = pid;
+    execd[num_pids] = 0;
+
+    return num_pids++;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: syscount COMMAND [ARGS...]\n");
+        return 1;
+    }
+
+    pid_t top = fork();
+    if (top == 0) {
+        ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+        raise(SIGSTOP);
+        execvp(argv[1], argv + 1);
+        perror("execvp");
+        _exit(127);
+    }
+
+    int status;
+    waitpid(top, &status, 0);
+    ptrace(PTRACE_SETOPTIONS, top, NULL, PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEFORK
+        | PTRACE_O_TRACEVFORK | PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXEC | PTRACE_O_EXITKILL);
+    ptrace(PTRACE_SYSCALL, top, NULL, NULL);
+    find(top);
+
+    // Each call stops twice, on entry and on exit, so the counts are halved at the end.
+    // The top process's own exec of the command doesn't count
+    unsigned long shell_stops = 0, child_stops = 0;
+    int top_started = 0;
+    int exit_status = 0;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, __WALL)) > 0) {
+        int sig = 0;
+        int i = find(pid);
+
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            if (pid == top) {
+                exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            }
+            continue;
+        }
+        if (WIFSTOPPED(status)) {
+            int event = status >> 16;
+            if (WSTOPSIG(status) == (SIGTRAP | 0x80)) { // System call stop
+                if (pid == top && top_started) {
+                    shell_stops++;
+                } else if (pid != top && i >= 0 && !execd[i]) {
+                    child_stops++;
+                }
+            } else if (event == PTRACE_EVENT_EXEC) {
+                if (pid == top) {
+                    top_started = 1;
+                    shell_stops = 1; // Exit half of the exec itself
+                } else if (i >= 0) {
+                    execd[i] = 1;
+                }
+            } else if (event == 0 && WSTOPSIG(status) != SIGTRAP && WSTOPSIG(status) != SIGSTOP) {
+                sig = WSTOPSIG(status); // A real signal: deliver it
+            }
+        }
+        ptrace(PTRACE_SYSCALL, pid, NULL, (void *)(long)sig);
+    }
+
+    printf("%lu %lu\n", shell_stops / 2, child_stops / 2);
+
+    return exit_status;
+}
@@ -0,0 +1,24 @@
+#!/bin/sh
+# Glob expansion reuses directory listings, but never past a change: a cd
+# on the same line, or a file created since the listing was read.
+#
+# Usage: tests/glob_cache.sh [WSH]
+
+WSH=${1:-./wsh}
+
+. "$(dirname "$0")/lib.sh"
+
+mkdir "$DIR/a" "$DIR/b" "$DIR/c" "$DIR/d"
+touch "$DIR/a/only_in_a" "$DIR/b/only_in_b" "$DIR/c/a.log"
+
+check "glob after cd" "cd $DIR/a; echo *; cd $DIR/b; echo *" 'only_in_a
+only_in_b'
+
+check "glob after a new file" "cd $DIR/c; echo *.log; touch b.log; echo *.log" 'a.log
+a.log b.log'
+
+check "glob in a loop creating files" "cd $DIR/d; for i in 1 2 3; do touch f\$i; echo f*; done" 'f1
+f1 f2
+f1 f2 f3'
+
+exit $fail
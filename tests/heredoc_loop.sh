@@ -0,0 +1,45 @@
+#!/bin/sh
+# Heredocs inside for and while bodies: each pass reads its own copy of the
+# body, with variables expanded for that pass, and the body lines never run
+# as commands.
+#
+# Usage: tests/heredoc_loop.sh [WSH]
+
+WSH=${1:-./wsh}
+
+. "$(dirname "$0")/lib.sh"
+
+check "heredoc in for" 'for i in a b c
+do
+cat <<END
+body $i
+done
+END
+done' 'body a
+done
+body b
+done
+body c
+done'
+
+check "heredoc in while" 'n=0
+while test $n -lt 3; do
+cat <<END
+pass $n
+END
+n=$(expr $n + 1)
+done
+echo end' 'pass 0
+pass 1
+pass 2
+end'
+
+check "heredoc before a loop" 'cat <<A; for i in x y; do cat <<B; done
+first
+A
+again $i
+B' 'first
+again x
+again y'
+
+exit $fail
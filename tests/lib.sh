@@ -0,0 +1,32 @@
+# Shared by the test scripts: a scratch directory, and check, which runs a
+# script through wsh and compares its output and exit status.
+#
+# Scripts set WSH and then source this file.
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+export WSH_HISTFILE="$DIR/history"
+
+fail=0
+
+# check NAME SCRIPT EXPECTED [STATUS]: run SCRIPT through wsh and compare its
+# output with EXPECTED and its exit status with STATUS (0 by default)
+check() {
+    name=$1
+    want=${4:-0}
+    printf '%s\n' "$2" > "$DIR/script"
+    if [ -n "$3" ]; then
+        printf '%s\n' "$3" > "$DIR/expected"
+    else
+        : > "$DIR/expected"
+    fi
+    "$WSH" --headless < "$DIR/script" > "$DIR/out" 2>&1
+    status=$?
+    if [ $status -ne "$want" ] || ! cmp -s "$DIR/out" "$DIR/expected"; then
+        echo "FAIL $name (status $status, expected $want)"
+        diff "$DIR/expected" "$DIR/out"
+        fail=1
+    else
+        echo "ok   $name"
+    fi
+}
@@ -0,0 +1,42 @@
+#!/bin/sh
+# Exit statuses through && and || lists, exit and set -e, including a set -e
+# stop with a background job still running.
+#
+# Usage: tests/status.sh [WSH]
+
+WSH=${1:-./wsh}
+
+. "$(dirname "$0")/lib.sh"
+
+printf '#!/bin/sh\nexit 3\n' > "$DIR/fail3"
+chmod +x "$DIR/fail3"
+
+check "&& skips after a failure" 'false && echo no; echo $?' '1'
+
+check "|| runs after a failure" 'false || echo yes; echo $?' 'yes
+0'
+
+check "&& then ||" 'true && false || echo fallback' 'fallback'
+
+check "exit N" 'exit 7' '' 7
+
+check "exit with the last status" 'false; exit' '' 1
+
+check "set -e stops at a failure" 'set -e
+echo before
+false
+echo after' 'before' 1
+
+check "set -e ignores guarded failures" 'set -e
+false || echo guarded
+false && echo no
+true && false
+echo after' 'guarded' 1
+
+check "exit status of a command" "$DIR/fail3; echo \$?" '3'
+
+check "set -e with a background job" "set -e
+sleep 30 &
+$DIR/fail3" '' 3
+
+exit $fail
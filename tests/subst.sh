@@ -0,0 +1,28 @@
+#!/bin/sh
+# Command substitution: built-ins captured in-process, commands that need a
+# child, cat/head/wc falling back to the real tool, and nested $(...) each
+# running exactly once.
+#
+# Usage: tests/subst.sh [WSH]
+
+WSH=${1:-./wsh}
+
+. "$(dirname "$0")/lib.sh"
+
+printf '#!/bin/sh\necho x >> "%s"\necho bumped\n' "$DIR/bumps" > "$DIR/bump"
+chmod +x "$DIR/bump"
+printf 'one\ntwo\nthree\n' > "$DIR/three"
+
+check "external command" 'echo a$(echo b)c' 'abc'
+
+check "in-process wc on a file" "echo [\$(wc -l $DIR/three)]" "[3 $DIR/three]"
+
+check "cat falling back on a pipe" 'echo A$(cat <<<hello)B' 'AhelloB'
+
+check "wc falling back on a pipe" 'echo x$(wc -l <<<one)y' 'x1y'
+
+check "nested substitution" "echo \$(echo \$($DIR/bump))" 'bumped'
+
+check "nested substitution runs once" "cat $DIR/bumps" 'x'
+
+exit $fail
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // mremap, memmem, struct dirent64
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,18 +7,107 @@
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <errno.h>
-// #include "wsh.h"
-
-// Struct to store background jobs
-typedef struct { 
-    pid_t pid;
-    int id;
-    char* name;
-    int is_background;
-} job;
+#include <signal.h>
+#include <poll.h>
+#include <limits.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sched.h>
+#include <termios.h>
+#include <dirent.h>
+#include "wsh.h"
 
 int num_jobs = 0;
-job jobs[256];
+job jobs[MAX_JOBS];
+
+// Resource limits, indexed by LIMIT_* (flag letter, RLIMIT_* resource, description)
+static const char limit_flags[] = "vtnu";
+static const int limit_resources[NUM_LIMITS] = { RLIMIT_AS, RLIMIT_CPU, RLIMIT_NOFILE, RLIMIT_NPROC };
+static const char *limit_names[NUM_LIMITS] = { "address space", "cpu time", "open files", "processes" };
+
+limits default_limits = { { RLIM_INFINITY, RLIM_INFINITY, RLIM_INFINITY, RLIM_INFINITY } }; // Applied to everything the shell launches
+limits cmd_limits = { { RLIM_INFINITY, RLIM_INFINITY, RLIM_INFINITY, RLIM_INFINITY } }; // Set by the limit prefix for the current command
+
+timeout_spec cmd_timeout = { 0, SIGTERM, 0 }; // Set by the timeout prefix for the current command
+
+// Priority classes, indexed by PRIO_* (name, nice value, I/O priority, scheduler policy)
+static const char *prio_names[NUM_PRIOS] = { "interactive", "batch", "idle" };
+static const int prio_nice[NUM_PRIOS] = { 0, 10, 19 };
+static const int prio_io[NUM_PRIOS] = { IOPRIO_VALUE(IOPRIO_BE, 4), IOPRIO_VALUE(IOPRIO_BE, 7), IOPRIO_VALUE(IOPRIO_IDLE, 0) };
+static const int prio_policy[NUM_PRIOS] = { SCHED_OTHER, SCHED_BATCH, SCHED_IDLE };
+
+int default_prio = PRIO_INTERACTIVE; // Class of everything the shell launches
+int cmd_prio = -1; // Set by the prio prefix for the current command, -1 for the default
+static int max_jobs = 0; // Background jobs allowed to run at once, 0 for no limit
+static int starting_job = -1; // Index of the queued job execCMD is starting
+
+// Background job output spooling. The writer thread owns the spools; the table, the
+// tails and done flags are shared under spool_lock, which is never held across I/O
+static char *spool_dir = NULL; // NULL when job output isn't spooled
+static off_t spool_max = SPOOL_SIZE;
+static int spool_keep = SPOOL_KEEP;
+static spool *spools[MAX_SPOOLS]; // Oldest first
+static int num_spools = 0;
+static spool *spool_pending = NULL, **spool_pending_end = &spool_pending; // Handed over, not yet polled
+static int spool_wake = -1; // eventfd the shell pokes after handing one over
+static pthread_mutex_t spool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t spool_idle = PTHREAD_COND_INITIALIZER; // Signalled when the writer stops
+static int spool_stop = 0, spool_stopped = 0; // Shell exiting: the writer flushes and returns
+static int spool_detached = 0; // Set in the process that outlives the shell to finish the live spools
+int in_pipeline = 0; // Set in pipeline children, which share one process group
+volatile sig_atomic_t native_active = 0; // An in-process cat, head or wc is running
+volatile sig_atomic_t native_intr = 0; // Signal that interrupted it
+
+// Process group deadlines, all driven by one timerfd armed for the earliest
+static timer_entry timers[MAX_JOBS];
+static int num_timers = 0;
+static int timer_fd = -1;
+static pthread_mutex_t timer_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int last_status = 0; // Exit status of the last command line
+static int errexit = 0; // set -e: stop at the first unguarded failure
+static history hist = { -1, NULL, 0, 0, NULL, 0, 0, NULL, 0 };
+
+static var_store vars = { NULL, 0, 0, NULL, 1 }; // Shell variables, filled from environ on first use
+char **cmd_assigns = NULL; // VAR=x words for the current command
+int num_cmd_assigns = 0;
+
+int cmd_stdin = -1; // Heredoc or here-string fd for the current command's stdin
+static char *heredocs[MAX_HEREDOCS]; // Bodies read for the current line, in order, unexpanded
+static int num_heredocs = 0, next_heredoc = 0;
+static char **cmd_heredocs = NULL; // Bodies of the loop command being run, used instead
+static int num_cmd_heredocs = 0, next_cmd_heredoc = 0;
+
+static wsh_metrics *metrics = NULL; // Shared memory counters, created on first use
+static char metrics_name[64];
+static pid_t metrics_owner = 0;
+
+// Headless mode skips the prompt, terminal control and process groups, and
+// forwards signals to the foreground children instead
+static int headless = 0;
+static volatile pid_t fg_children[MAX_FANOUT + 1]; // Foreground processes being waited for
+static volatile sig_atomic_t num_fg_children = 0;
+static int exec_in_place = 0; // wsh -c with a single command: exec it without forking
+
+static serve_client clients[SERVE_MAX_CLIENTS]; // wsh --serve connections
+static int serve_running = 0, serve_waiting = 0; // Requests in a worker, and waiting for a slot
+
+// Class of the command being started
+static int current_prio() {
+    return cmd_prio >= 0 ? cmd_prio : default_prio;
+}
 
 // Add a job to list of background jobs
 void add_job(pid_t pid, char* name, int isBG) { 
@@ -25,7 +115,35 @@ void add_job(pid_t pid, char* name, int isBG) {
     jobs[num_jobs].id = num_jobs + 1; // Set job ID
     jobs[num_jobs].name = strdup(name); // Set name/cmd of job
     jobs[num_jobs].is_background = isBG; // Set whether job is a background job
+    jobs[num_jobs].state = JOB_RUNNING;
+    jobs[num_jobs].limit_hit = -1;
+    for (int i = 0; i < NUM_LIMITS; i++) {
+        jobs[num_jobs].lim.value[i] = RLIM_INFINITY;
+    }
+    jobs[num_jobs].prio = current_prio();
+    jobs[num_jobs].slot = 0;
+    jobs[num_jobs].queued = NULL;
     num_jobs++;
+    metrics_jobs();
+}
+
+// Free a queued command's copy of its words and stdin
+static void free_queued(queued_cmd *q) {
+    if (q == NULL) {
+        return;
+    }
+    for (int i = 0; i < q->num_args; i++) {
+        free(q->args[i]);
+    }
+    for (int i = 0; i < q->num_assigns; i++) {
+        free(q->assigns[i]);
+    }
+    free(q->args);
+    free(q->assigns);
+    if (q->in != -1) {
+        close(q->in);
+    }
+    free(q);
 }
 
 // Remove a job from list of background jobs
@@ -36,6 +154,7 @@ void remove_job(int id) {
     for (i = 0; i < num_jobs; i++) {
         if (jobs[i].id == id) {
             free(jobs[i].name); // Free the name of the job
+            free_queued(jobs[i].queued);
             // Shift all jobs after the removed job to the left
             while (i < num_jobs - 1) {
                 jobs[i] = jobs[i + 1];
@@ -45,12 +164,15 @@ void remove_job(int id) {
             break;
         }
     }
+    metrics_jobs();
 }
 
 // Print list of background jobs
 void print_jobs() { 
     int i;
 
+    update_jobs(); // Pick up jobs that finished since the last prompt
+
     // Iterate through list of jobs and print each job
     for (i = 0; i < num_jobs; i++) {
         printf("%d: %s", jobs[i].id, jobs[i].name);
@@ -58,355 +180,5922 @@ void print_jobs() {
         if (jobs[i].is_background) {
             printf(" &");
         }
+        printf(" [%s]", prio_names[jobs[i].prio]);
+        if (jobs[i].state == JOB_QUEUED) {
+            printf(" (queued)");
+        } else if (jobs[i].state == JOB_STOPPED) {
+            printf(" (stopped)");
+        } else if (jobs[i].state == JOB_LIMIT) {
+            printf(" (killed: %s limit)", limit_names[jobs[i].limit_hit]);
+        } else if (jobs[i].state == JOB_TIMEOUT) {
+            printf(" (timed out)");
+        }
         printf("\n");
     }
-}
 
-// Handle signals
-void handle_signal(int signum) { 
-    if (signum == SIGINT) { // SIGINT signal
-        pid_t pid = tcgetpgrp(STDIN_FILENO); // Get foreground process group
-        if (pid > 0) { // If foreground process group exists
-            kill(-pid, SIGINT); // Send SIGINT signal to process group to terminate the process
-        }
-    } else if (signum == SIGTSTP) { // SIGTSTP signal
-        pid_t pid = tcgetpgrp(STDIN_FILENO); // Get foreground process group
-        if (pid > 0) { // If foreground process group exists
-            kill(-pid, SIGTSTP); // Send SIGTSTP signal to process group to stop the process
+    // Jobs killed by a limit or timeout are reported once, then dropped
+    for (i = num_jobs - 1; i >= 0; i--) {
+        if (jobs[i].state == JOB_LIMIT || jobs[i].state == JOB_TIMEOUT) {
+            remove_job(jobs[i].id);
         }
     }
 }
 
-// Set given process to foreground
-void set_foreground(pid_t pid) { 
-    tcsetpgrp(STDIN_FILENO, pid); // Set foreground process group to given process
-    signal(SIGINT, SIG_DFL); // Set signal handler for SIGINT to default
-    signal(SIGTSTP, SIG_DFL); // Set signal handler for SIGTSTP to default
-    kill(-pid, SIGCONT); // Send SIGCONT signal to process group to continue the process
-    int status;
-    waitpid(pid, &status, WUNTRACED); // Wait for process to finish or be stopped
-    signal(SIGINT, handle_signal); // Set signal handler for SIGINT back to handle_signal
-    signal(SIGTSTP, handle_signal); // Set signal handler for SIGTSTP back to handle_signal
-    tcsetpgrp(STDIN_FILENO, getpid()); // Set foreground process group back to shell
-}
+// jobs built-in: jobs [-j [N] | -o ID]
+// -j shows or sets how many jobs started with & may run at once; the rest queue.
+// -o prints the latest output of a spooled job
+int jobs_builtin(char **args, int num_args) {
+    if (num_args == 1) {
+        print_jobs();
+        return 0;
+    }
+    if (strcmp(args[1], "-o") == 0 && num_args == 3) {
+        return spool_print(atoi(args[2]));
+    }
+    if (strcmp(args[1], "-j") != 0 || num_args > 3) {
+        printf("Usage: jobs [-j [N] | -o ID]\n");
+        return -1;
+    }
+    if (num_args == 2) {
+        if (max_jobs == 0) {
+            printf("unlimited\n");
+        } else {
+            printf("%d\n", max_jobs);
+        }
+        return 0;
+    }
+    char *end;
+    long n = strtol(args[2], &end, 10);
+    if (*end != '\0' || n < 0 || n > MAX_JOBS) {
+        printf("jobs: invalid slot count %s\n", args[2]);
+        return -1;
+    }
+    max_jobs = n;
+    start_queued(); // More slots may have opened up
 
-// Set given process to background
-void set_background(pid_t pid) {
-    add_job(pid, "background", 1); // Add process to list of background jobs
-    // Set given process to background using pid
-    tcsetpgrp(STDIN_FILENO, getpid()); // Set foreground process group back to shell
-    kill(-pid, SIGCONT); // Send SIGCONT signal to process group to continue the process
+    return 0;
 }
 
-// Parse the input line into separate commands
-void parseCmds(char *line, char ***commands, int *num_commands) {
-    char *token;
-    *num_commands = 0;
-    token = strtok(line, ";");
+// Reap finished background jobs without blocking and update their state
+void update_jobs() {
+    int i, status;
+    struct rusage ru;
 
-    // While still cmds to parse
-    while (token != NULL) { // 
-        (*commands)[*num_commands] = token; // Add cmd to list of cmds
-        (*num_commands)++; // Increment number of cmds
-        token = strtok(NULL, ";"); // Get next cmd
+    for (i = num_jobs - 1; i >= 0; i--) {
+        if (jobs[i].state == JOB_LIMIT || jobs[i].state == JOB_TIMEOUT) {
+            continue; // Already reaped, waiting to be reported
+        }
+        if (jobs[i].state == JOB_QUEUED) {
+            continue; // No process yet
+        }
+        pid_t r = wait4(jobs[i].pid, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru);
+        if (r == 0) { // Still running
+            continue;
+        }
+        if (r < 0) { // No longer our child
+            timer_remove(jobs[i].pid);
+            remove_job(jobs[i].id);
+            continue;
+        }
+        if (!WIFSTOPPED(status) && !WIFCONTINUED(status)) {
+            metrics_reaped(&ru);
+        }
+        if (WIFSTOPPED(status)) {
+            jobs[i].state = JOB_STOPPED;
+            metrics_jobs();
+        } else if (WIFCONTINUED(status)) {
+            jobs[i].state = JOB_RUNNING;
+            metrics_jobs();
+        } else if (timer_remove(jobs[i].pid)) { // Keep it in the table until jobs reports it
+            jobs[i].state = JOB_TIMEOUT;
+            metrics_jobs();
+        } else {
+            int hit = limit_killed(&jobs[i].lim, status, &ru);
+            if (hit >= 0) { // Keep it in the table until jobs reports it
+                jobs[i].state = JOB_LIMIT;
+                jobs[i].limit_hit = hit;
+                metrics_jobs();
+            } else {
+                remove_job(jobs[i].id);
+            }
+        }
     }
+    start_queued(); // Into the slots just freed
+    coproc_reap();
 }
- 
-// Split line into arguments
-int sepArgs(char *line, char ***args, int *num_args) {
-    *num_args = 0;
 
-    // Count num args
-    char *l = strdup(line); // Copy line
-    if(l == NULL){
-        return -1;
+// Background jobs holding a slot
+static int slots_used() {
+    int n = 0;
+    for (int i = 0; i < num_jobs; i++) {
+        n += jobs[i].slot && jobs[i].state == JOB_RUNNING;
     }
+    return n;
+}
 
-    char *token = strtok(l, " \t\n"); // Get first arg
-    while(token != NULL){
-        (*num_args)++; // Increment num args
-        token = strtok(NULL, " \t\n"); // Get next arg
+// Jobs waiting for a slot
+static int queued_jobs() {
+    int n = 0;
+    for (int i = 0; i < num_jobs; i++) {
+        n += jobs[i].state == JOB_QUEUED;
     }
-    free(l);
+    return n;
+}
 
-    // Split line into args
-    *args = malloc(sizeof(char **) * (*num_args+1));
-    *num_args = 0;
-    token = strtok(line, " \t\n"); // Get next arg
-    while(token != NULL){
-        char *token_copy = strdup(token); // Copy arg
-        if(token_copy == NULL){
-            return -1;
+// Queue a background command until a slot frees up. The words and heredoc fd
+// belong to the line being run, so the job keeps copies
+static int queue_job(char **args, int num_args, const limits *lim) {
+    if (num_jobs == MAX_JOBS) {
+        printf("%s: too many jobs\n", args[0]);
+        return -1;
+    }
+    queued_cmd *q = calloc(1, sizeof(queued_cmd));
+    if (q == NULL || (q->args = calloc(num_args + 2, sizeof(char *))) == NULL
+            || (q->assigns = calloc(num_cmd_assigns + 1, sizeof(char *))) == NULL) {
+        perror("calloc");
+        if (q != NULL) {
+            free(q->args);
         }
-
-        (*args)[(*num_args)++] = token_copy; // Add arg to list of args
-        token = strtok(NULL, " \t\n"); // Get next arg
+        free(q);
+        return -1;
+    }
+    for (int i = 0; i < num_args; i++) {
+        q->args[i] = strdup(args[i]);
     }
+    q->args[num_args] = "&"; // Not counted in num_args, so never freed
+    q->num_args = num_args;
+    for (int i = 0; i < num_cmd_assigns; i++) {
+        q->assigns[i] = strdup(cmd_assigns[i]);
+    }
+    q->num_assigns = num_cmd_assigns;
+    q->timeout = cmd_timeout;
+    q->in = cmd_stdin == -1 ? -1 : fcntl(cmd_stdin, F_DUPFD_CLOEXEC, 0);
+
+    add_job(0, args[0], 1);
+    job *j = &jobs[num_jobs - 1];
+    j->state = JOB_QUEUED;
+    j->lim = *lim;
+    j->slot = 1;
+    j->queued = q;
+    metrics_jobs();
 
     return 0;
 }
 
-// Execute command
-int execCMD(char **args, int num_args) {
-    pid_t pid;
-    // Set signal handlers for SIGINT and SIGTSTP to default
-    signal(SIGINT, SIG_DFL);
-    signal(SIGTSTP, SIG_DFL);
-    
-    pid = fork(); // Fork
+// Start the queued job at index i with the limits, class, timeout, assignments
+// and stdin it was queued with
+void job_start(int i) {
+    queued_cmd *q = jobs[i].queued;
+    limits saved_limits = cmd_limits;
+    timeout_spec saved_timeout = cmd_timeout;
+    int saved_prio = cmd_prio, saved_stdin = cmd_stdin, saved_num_assigns = num_cmd_assigns;
+    char **saved_assigns = cmd_assigns;
 
-    if (pid < 0) { // Fork error
-        perror("fork");
-        exit(-1);
-    } else if (pid == 0) { // Child process
-        if (getpid() != getsid(0)) {
-            // The shell is not a session leader
-            setpgid(0,0); // Set process group ID to new process group
-        }
-        // setpgid(0,0); // Set process group ID to new process group
+    cmd_limits = jobs[i].lim;
+    cmd_timeout = q->timeout;
+    cmd_prio = jobs[i].prio;
+    cmd_stdin = q->in;
+    cmd_assigns = q->assigns;
+    num_cmd_assigns = q->num_assigns;
+    starting_job = i;
+    execCMD(q->args, q->num_args + 1);
+    starting_job = -1;
+    cmd_limits = saved_limits;
+    cmd_timeout = saved_timeout;
+    cmd_prio = saved_prio;
+    cmd_stdin = saved_stdin;
+    cmd_assigns = saved_assigns;
+    num_cmd_assigns = saved_num_assigns;
 
-        // Execute command
-        if (execvp(args[0], args) == -1) { // If execvp() returns, error
-            perror("execvp");
-            exit(-1);
-        }
-    } else { // Parent process
-        // Check through the jobs struct to see if the process is a background job
-        int isBG = 0;
+    jobs[i].queued = NULL;
+    free_queued(q);
+}
+
+// Start queued jobs while there are free slots, highest class first and in
+// the order they were queued within a class
+void start_queued() {
+    while (max_jobs == 0 || slots_used() < max_jobs) {
+        int next = -1;
         for (int i = 0; i < num_jobs; i++) {
-            if (jobs[i].pid == pid) { // If the process is a background job
-                isBG = 1; // Set isBG to true
-                break;
+            if (jobs[i].state == JOB_QUEUED && (next == -1 || jobs[i].prio < jobs[next].prio)) {
+                next = i;
             }
         }
-
-        if (!isBG) { // If foreground
-            int status;
-            waitpid(pid, &status, 0); // Wait for child process to finish
-            // If child process was stopped, add it to the list of background jobs
-            if (WIFSTOPPED(status)) { 
-                add_job(pid, args[0], 1);
-            }
-        } else { // Background job
-            // Add the job to the list of background jobs
-            add_job(pid, args[0], 1);
-            
-            if (getpid() != getsid(0)) {
-                // The shell is not a session leader
-                setpgid(pid, jobs[num_jobs - 1].id); // Set the process group ID of the child process to the job ID
-            }
-            // setpgid(pid, jobs[num_jobs - 1].id);
+        if (next == -1) {
+            return;
         }
-        // waitpid(pid, &status, 0);
+        job_start(next);
     }
-
-    return 0;
 }
 
-// Execute cmd. First checks for built-in cmds. If not, passes to execCMD()
-int execute(char **args, int num_args) {
-    // Built-in Commands
-    if(strcmp(args[0], "cd") == 0) { // cd built-in command
-        // Checking num args
-        if (num_args != 2) {
-            printf("cd: invalid arguments\n");
-            return -1;
+// wait built-in: block until every job started with & has finished, queued ones
+// included. Exits are only peeked at with WNOWAIT so update_jobs still reaps and reports them
+int wait_jobs() {
+    for (;;) {
+        update_jobs();
+        int busy = 0;
+        for (int i = 0; i < num_jobs; i++) {
+            busy |= jobs[i].slot && (jobs[i].state == JOB_RUNNING || jobs[i].state == JOB_QUEUED);
         }
-        if (chdir(args[1]) == -1) { // Using chdir() with passed arg. If return, error
-            perror("chdir");
-            return -1;
+        if (!busy) {
+            return 0;
         }
-
-        return 0;
-    } else if (strcmp(args[0], "jobs") == 0) { // jobs built-in command
-        if (num_args > 1) {
-            printf("jobs: too many arguments\n");
-            return -1;
+        siginfo_t info;
+        info.si_pid = 0;
+        if (waitid(P_ALL, 0, &info, WEXITED | WNOWAIT) == -1) {
+            if (errno == ECHILD) {
+                return 0;
+            }
+            return -1; // Interrupted
         }
-        print_jobs();
-
-        return 0;
-    } else if (strcmp(args[0], "fg") == 0) { // fg built-in command
-        if (num_args > 2) {
-            perror("fg: too many arguments\n");
-            return -1;
+        update_jobs();
+        int known = 0;
+        for (int i = 0; i < num_jobs; i++) {
+            known |= jobs[i].pid == info.si_pid;
         }
-        int id = num_jobs;
-        if (num_args == 2) {
-            id = atoi(args[1]); // Parse job ID to int
-
-            // If job ID is invalid, error
-            if (id <= 0 || id > num_jobs) { 
-                perror("fg: invalid job id\n");
-                return -1;
-            }
+        if (!known) { // Not a job, so nothing else would ever reap it
+            waitpid(info.si_pid, NULL, WNOHANG);
         }
-        job j = jobs[id - 1]; // Get job with given ID
-        remove_job(id); // Remove job from list of background jobs
-        set_foreground(j.pid); // Set job to foreground
+    }
+}
 
-        return 0;
-    } else if (strcmp(args[0], "bg") == 0) { // bg built-in command
-        if (num_args > 2) {
-            perror("bg: too many arguments\n");
-            return -1;
-        }
+// Remove the metrics segment when the shell exits
+static void metrics_cleanup() {
+    if (metrics != NULL && getpid() == metrics_owner) {
+        shm_unlink(metrics_name);
+    }
+}
 
-        int id = num_jobs; // Default to last job
-        if (num_args == 2) {
-            id = atoi(args[1]); // Parse job ID to int
+// Create the metrics segment, /dev/shm/wsh.PID, on first use. Returns NULL if unavailable
+static wsh_metrics *metrics_get() {
+    static int failed = 0;
 
-            // If job ID is invalid, error
-            if (id <= 0 || id > num_jobs) { 
-                perror("bg: invalid job id\n");
-                return -1;
-            }
+    if (metrics != NULL || failed) {
+        return metrics;
+    }
+    snprintf(metrics_name, sizeof(metrics_name), METRICS_PREFIX "%d", (int)getpid());
+    int fd = shm_open(metrics_name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1 || ftruncate(fd, sizeof(wsh_metrics)) == -1) {
+        if (fd != -1) {
+            close(fd);
+            shm_unlink(metrics_name);
         }
-        job j = jobs[id - 1]; // Get job with given ID
-        // remove_job(id); 
-        set_background(j.pid); // Set job to background
-        
-        return 0;
-    } 
+        failed = 1;
+        return NULL;
+    }
+    void *map = mmap(NULL, sizeof(wsh_metrics), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        shm_unlink(metrics_name);
+        failed = 1;
+        return NULL;
+    }
+    metrics = map;
+    metrics->magic = METRICS_MAGIC;
+    metrics->pid = getpid();
+    metrics_owner = getpid();
+    atexit(metrics_cleanup);
 
-    // Other exec program
-    int a = execCMD(args, num_args);
-    return a;
-    
-    return 0;
+    return metrics;
 }
 
-// Execute pipe
-int execPipe(char **args, int num_args, char **pipedArgs, int numPipedArgs) {
-    int pipefd[2]; // pipefd[0] is read end, pipefd[1] is write end
-    if (pipe(pipefd) == -1) {
-        perror("pipe");
-        exit(-1);
+// Seqlock write side. Only the shell's main thread writes, so no lock is needed;
+// readers retry if the sequence was odd or changed while they copied
+static void metrics_begin() {
+    __atomic_store_n(&metrics->seq, metrics->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void metrics_end() {
+    __atomic_store_n(&metrics->seq, metrics->seq + 1, __ATOMIC_RELEASE);
+}
+
+// Count a launched command and how long its fork took
+void metrics_spawn(const struct timespec *start) {
+    struct timespec now;
+
+    if (metrics_get() == NULL) {
+        return;
     }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long us = (now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+    int bucket = 0;
+    while (bucket < METRICS_BUCKETS - 1 && us >= (1L << bucket)) {
+        bucket++;
+    }
+    metrics_begin();
+    metrics->commands++;
+    metrics->spawn_hist[bucket]++;
+    metrics_end();
+}
 
-    //printf("%d, and %d", pipefd[0], pipefd[1]);
+// Add a reaped child's CPU time
+void metrics_reaped(const struct rusage *ru) {
+    if (metrics == NULL) {
+        return;
+    }
+    metrics_begin();
+    metrics->child_cpu_us += ru->ru_utime.tv_sec * 1000000 + ru->ru_utime.tv_usec
+        + ru->ru_stime.tv_sec * 1000000 + ru->ru_stime.tv_usec;
+    metrics_end();
+}
 
-    int pid = fork();
-    if (pid == 0){ // Child
-        dup2(pipefd[1], STDOUT_FILENO); // Redirect stdout to pipe
-        close(pipefd[1]); // Close write end
-        close(pipefd[0]); // Close read end
-        execute(args, num_args); // Execute first command
+// Recount running jobs after the job table or the foreground command changed
+void metrics_jobs() {
+    if (metrics == NULL) {
+        return;
+    }
+    uint64_t running = num_fg_children, queued = 0;
+    for (int i = 0; i < num_jobs; i++) {
+        running += jobs[i].state == JOB_RUNNING;
+        queued += jobs[i].state == JOB_QUEUED;
+    }
+    running += serve_running;
+    queued += serve_waiting;
+    metrics_begin();
+    metrics->running_jobs = running;
+    metrics->queue_depth = queued;
+    metrics_end();
+}
 
-        exit(0);
-    } else { // Parent
-        pid = fork(); // Fork again because we need two processes
+// A forked copy of the shell that goes on to run commands itself (pipeline
+// sides, $(...)) shares the parent's job state, so it must not touch it
+void subshell_init() {
+    in_pipeline = 1;
+    metrics = NULL; // Keep a single writer on the seqlock
+}
 
-        if(pid == 0) { // Child
-            dup2(pipefd[0], STDIN_FILENO); // Redirect stdin to pipe
-            close(pipefd[0]); // Close read end
-            close(pipefd[1]); // Close write end
-            execute(pipedArgs, numPipedArgs); // Execute second command
+// Parse a byte count with an optional K, M or G suffix into *size.
+// Returns -1 if it isn't one, is negative or doesn't fit
+int parse_size(const char *str, long long *size) {
+    char *end;
+    int shift = 0;
 
-            exit(0);
-        } else { // parent
-            int status; 
-            close(pipefd[1]); // Close write end
-            close(pipefd[0]); // Close read end
-            waitpid(pid, &status, 0); // Wait for child process to finish
-        } 
+    errno = 0;
+    long long v = strtoll(str, &end, 10);
+    if (*end != '\0' && end[1] == '\0') {
+        switch (*end) {
+            case 'K': case 'k': shift = 10; end++; break;
+            case 'M': case 'm': shift = 20; end++; break;
+            case 'G': case 'g': shift = 30; end++; break;
+        }
+    }
+    if (errno != 0 || end == str || *end != '\0' || v < 0 || v > LLONG_MAX >> shift) {
+        return -1;
     }
+    *size = v << shift;
 
     return 0;
 }
 
-int main() {
-    // Set signal handlers for SIGINT and SIGTSTP to handle_signal
-    signal(SIGINT, handle_signal);
-    signal(SIGTSTP, handle_signal);
+// Parse limit options (-v SIZE, -t SECS, -n FILES, -u PROCS) into lim.
+// Returns the index of the first non-option arg, or -1 on error
+int parse_limits(char **args, int num_args, limits *lim) {
+    int i = 1;
 
-    char **args;
-    char **commands = (char **)malloc(256 * sizeof(char *)); // List of commands
-    int num_args, num_commands;
-    char *buffer;
-    size_t bufsize = 256;
-    int hasPipe = 0;
-    int pipeInd = -1;
-
-    setbuf(stdout, NULL); // Disable buffering for stdout
+    while (i < num_args && args[i][0] == '-') {
+        if (strcmp(args[i], "--") == 0) { // End of options
+            return i + 1;
+        }
+        const char *flag = strchr(limit_flags, args[i][1]);
+        if (args[i][1] == '\0' || args[i][2] != '\0' || flag == NULL || i + 1 >= num_args) {
+            printf("limit: invalid option %s\n", args[i]);
+            return -1;
+        }
+        int which = flag - limit_flags;
+        char *val = args[i + 1];
 
-    buffer = (char *)malloc(bufsize * sizeof(char));
-    if(buffer == NULL)
-    {
-        perror("buffer");
-        exit(-1);
+        if (strcmp(val, "unlimited") == 0) {
+            lim->value[which] = RLIM_INFINITY;
+        } else if (which == LIMIT_AS) { // Address space accepts K, M and G suffixes
+            long long v;
+            if (parse_size(val, &v) == -1) {
+                printf("limit: invalid value %s\n", val);
+                return -1;
+            }
+            lim->value[which] = v;
+        } else {
+            char *end;
+            errno = 0;
+            unsigned long long v = strtoull(val, &end, 10);
+            if (errno != 0 || end == val || *end != '\0' || val[0] == '-') {
+                printf("limit: invalid value %s\n", val);
+                return -1;
+            }
+            lim->value[which] = v;
+        }
+        i += 2;
     }
 
-    // Main loop
-    while(1) {
-        printf("wsh> ");
+    return i;
+}
 
-        // Read the input line from the user
-        if (getline(&buffer, &bufsize, stdin) != -1) {
-            
-            // Parse the input line into separate commands
-            parseCmds(buffer, &commands, &num_commands);
-
-            // Execute each command
-            for (int i = 0; i < num_commands; i++) {
-                hasPipe = 0;
-                // Split command line into arguments
-                sepArgs(commands[i], &args, &num_args);
-
-                // Skip if no args
-                if(num_args == 0) {
-                    continue;
+// Apply limits to the calling process. Called in the child between fork and exec
+void apply_limits(const limits *lim) {
+    for (int i = 0; i < NUM_LIMITS; i++) {
+        if (lim->value[i] == RLIM_INFINITY) {
+            continue;
+        }
+        struct rlimit rl;
+        if (getrlimit(limit_resources[i], &rl) == -1) {
+            perror("getrlimit");
+            continue;
+        }
+        rl.rlim_cur = lim->value[i];
+        // Leave one second of headroom on CPU so the child gets SIGXCPU before SIGKILL
+        rlim_t hard = (i == LIMIT_CPU) ? lim->value[i] + 1 : lim->value[i];
+        if (hard < rl.rlim_max) { // Can only ever lower the hard limit
+            rl.rlim_max = hard;
+        }
+        if (rl.rlim_cur > rl.rlim_max) {
+            rl.rlim_cur = rl.rlim_max;
+        }
+        if (setrlimit(limit_resources[i], &rl) == -1) {
+            perror("setrlimit");
+        }
+    }
+}
+
+// Decide whether a child was killed by one of its limits.
+// Returns the LIMIT_* that was hit, or -1. Running out of files or processes
+// shows up as failed syscalls rather than a signal, so only AS and CPU are detected.
+// An AS cap never sends a signal of its own: a failed allocation turns into
+// SIGSEGV, SIGBUS or SIGABRT, and so do plain crashes. Blame the cap only when
+// the child's peak RSS got to at least half of it; otherwise the caller just
+// reports the signal
+int limit_killed(const limits *lim, int status, const struct rusage *ru) {
+    if (!WIFSIGNALED(status)) {
+        return -1;
+    }
+    int sig = WTERMSIG(status);
+
+    if (lim->value[LIMIT_CPU] != RLIM_INFINITY) {
+        rlim_t used = ru->ru_utime.tv_sec + ru->ru_stime.tv_sec;
+        if (sig == SIGXCPU || (sig == SIGKILL && used >= lim->value[LIMIT_CPU])) {
+            return LIMIT_CPU;
+        }
+    }
+    if (lim->value[LIMIT_AS] != RLIM_INFINITY && (sig == SIGSEGV || sig == SIGBUS || sig == SIGABRT)) {
+        rlim_t rss = (rlim_t)ru->ru_maxrss * 1024; // ru_maxrss is in KiB
+        if (rss >= lim->value[LIMIT_AS] / 2) {
+            return LIMIT_AS;
+        }
+    }
+
+    return -1;
+}
+
+// limit built-in: with no command, prints or sets the defaults for everything
+// the shell launches; with a command, runs it under the given limits
+int limit_builtin(char **args, int num_args) {
+    if (num_args == 1) {
+        for (int i = 0; i < NUM_LIMITS; i++) {
+            printf("%-14s (-%c) ", limit_names[i], limit_flags[i]);
+            if (default_limits.value[i] == RLIM_INFINITY) {
+                printf("unlimited\n");
+            } else {
+                printf("%llu\n", (unsigned long long)default_limits.value[i]);
+            }
+        }
+        return 0;
+    }
+
+    limits lim = cmd_limits;
+    int cmd = parse_limits(args, num_args, &lim);
+    if (cmd < 0) {
+        return -1;
+    }
+    if (cmd >= num_args) { // No command, so update the shell defaults
+        lim = default_limits;
+        parse_limits(args, num_args, &lim);
+        default_limits = lim;
+        return 0;
+    }
+
+    limits saved = cmd_limits;
+    cmd_limits = lim;
+    int ret = execute(args + cmd, num_args - cmd);
+    cmd_limits = saved;
+
+    return ret;
+}
+
+// Handle signals
+void handle_signal(int signum) { 
+    if (native_active && signum == SIGINT) { // Stop an in-process cat, head or wc
+        native_intr = signum;
+    } else if (signum == SIGINT) { // SIGINT signal
+        pid_t pid = tcgetpgrp(STDIN_FILENO); // Get foreground process group
+        if (pid > 0) { // If foreground process group exists
+            kill(-pid, SIGINT); // Send SIGINT signal to process group to terminate the process
+        }
+    } else if (signum == SIGTSTP) { // SIGTSTP signal
+        pid_t pid = tcgetpgrp(STDIN_FILENO); // Get foreground process group
+        if (pid > 0) { // If foreground process group exists
+            kill(-pid, SIGTSTP); // Send SIGTSTP signal to process group to stop the process
+        }
+    }
+}
+
+// Headless mode: pass signals on to the foreground children, or take the
+// default action when there are none
+void forward_signal(int signum) {
+    if (native_active) { // Stop an in-process cat, head or wc
+        native_intr = signum;
+        return;
+    }
+    if (num_fg_children == 0) {
+        signal(signum, SIG_DFL);
+        raise(signum);
+        return;
+    }
+    for (int i = 0; i < num_fg_children; i++) {
+        kill(fg_children[i], signum);
+    }
+}
+
+// Install the shell's signal handlers. With -c this waits until the first
+// command that the shell has to wait for
+void signals_init() {
+    static int done = 0;
+
+    if (done) {
+        return;
+    }
+    done = 1;
+    if (headless) {
+        signal(SIGINT, forward_signal);
+        signal(SIGTERM, forward_signal);
+        signal(SIGHUP, forward_signal);
+        signal(SIGQUIT, forward_signal);
+    } else {
+        // Set signal handlers for SIGINT and SIGTSTP to handle_signal
+        signal(SIGINT, handle_signal);
+        signal(SIGTSTP, handle_signal);
+    }
+}
+
+// Signal a job's process group. Headless jobs usually have no group of their own
+static void signal_job(pid_t pid, int sig) {
+    if (kill(-pid, sig) == -1 && headless) {
+        kill(pid, sig);
+    }
+}
+
+// Set given process to foreground
+void set_foreground(pid_t pid) { 
+    if (headless) {
+        int status;
+        signal_job(pid, SIGCONT);
+        fg_children[0] = pid;
+        num_fg_children = 1;
+        waitpid(pid, &status, WUNTRACED);
+        num_fg_children = 0;
+        return;
+    }
+    tcsetpgrp(STDIN_FILENO, pid); // Set foreground process group to given process
+    signal(SIGINT, SIG_DFL); // Set signal handler for SIGINT to default
+    signal(SIGTSTP, SIG_DFL); // Set signal handler for SIGTSTP to default
+    kill(-pid, SIGCONT); // Send SIGCONT signal to process group to continue the process
+    int status;
+    waitpid(pid, &status, WUNTRACED); // Wait for process to finish or be stopped
+    signal(SIGINT, handle_signal); // Set signal handler for SIGINT back to handle_signal
+    signal(SIGTSTP, handle_signal); // Set signal handler for SIGTSTP back to handle_signal
+    tcsetpgrp(STDIN_FILENO, getpid()); // Set foreground process group back to shell
+}
+
+// Set given process to background
+void set_background(pid_t pid) {
+    add_job(pid, "background", 1); // Add process to list of background jobs
+    // Set given process to background using pid
+    if (!headless) {
+        tcsetpgrp(STDIN_FILENO, getpid()); // Set foreground process group back to shell
+    }
+    signal_job(pid, SIGCONT); // Send SIGCONT signal to process group to continue the process
+}
+
+// Parse a duration like 10, 1.5, 2m or 1h into seconds. Returns -1 on error
+double parse_duration(const char *str) {
+    char *end;
+    errno = 0;
+    double secs = strtod(str, &end);
+    if (errno != 0 || end == str || secs < 0) {
+        return -1;
+    }
+    switch (*end) {
+        case '\0': case 's': break;
+        case 'm': secs *= 60; break;
+        case 'h': secs *= 60 * 60; break;
+        case 'd': secs *= 24 * 60 * 60; break;
+        default: return -1;
+    }
+    if (*end != '\0' && end[1] != '\0') {
+        return -1;
+    }
+
+    return secs;
+}
+
+// Parse a signal given as a number, TERM or SIGTERM. Returns -1 on error
+int parse_signal(const char *str) {
+    static const struct { const char *name; int sig; } names[] = {
+        { "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "KILL", SIGKILL },
+        { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 }, { "ALRM", SIGALRM }, { "TERM", SIGTERM },
+        { "CONT", SIGCONT }, { "STOP", SIGSTOP }, { "TSTP", SIGTSTP },
+    };
+
+    if (*str >= '0' && *str <= '9') {
+        int sig = atoi(str);
+        return (sig > 0 && sig < NSIG) ? sig : -1;
+    }
+    if (strncmp(str, "SIG", 3) == 0) {
+        str += 3;
+    }
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(str, names[i].name) == 0) {
+            return names[i].sig;
+        }
+    }
+
+    return -1;
+}
+
+// Add seconds to a CLOCK_MONOTONIC timestamp
+static struct timespec deadline_after(double secs) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    long long ns = ts.tv_nsec + (long long)((secs - (long long)secs) * 1e9);
+    ts.tv_sec += (time_t)secs + ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    return ts;
+}
+
+static int ts_before(const struct timespec *a, const struct timespec *b) {
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+// Arm the timerfd for the earliest pending deadline. Caller holds timer_lock
+static void timer_rearm() {
+    struct itimerspec its = { { 0, 0 }, { 0, 0 } }; // Disarmed when nothing is pending
+
+    for (int i = 0; i < num_timers; i++) {
+        if (timers[i].fired < 2 && (its.it_value.tv_sec == 0 || ts_before(&timers[i].deadline, &its.it_value))) {
+            its.it_value = timers[i].deadline;
+        }
+    }
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+// Timer thread: sleeps on the timerfd and signals process groups whose time ran out
+static void *timer_thread(void *arg) {
+    (void)arg;
+    uint64_t expirations;
+
+    while (1) {
+        if (read(timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+            continue; // Interrupted or re-armed before expiring
+        }
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        pthread_mutex_lock(&timer_lock);
+        for (int i = 0; i < num_timers; i++) {
+            timer_entry *t = &timers[i];
+            if (t->fired == 2 || ts_before(&now, &t->deadline)) {
+                continue;
+            }
+            if (t->fired == 0) { // First expiry: send the requested signal
+                kill(-t->pgid, t->spec.sig);
+                kill(-t->pgid, SIGCONT); // Stopped jobs need to run to see it
+                t->fired = t->spec.kill_after > 0 ? 1 : 2;
+                t->deadline = deadline_after(t->spec.kill_after);
+            } else { // Still alive after the grace period
+                kill(-t->pgid, SIGKILL);
+                t->fired = 2;
+            }
+        }
+        timer_rearm();
+        pthread_mutex_unlock(&timer_lock);
+    }
+
+    return NULL;
+}
+
+// Start the timer thread on first use. Returns -1 on error
+static int timer_init() {
+    if (timer_fd != -1) {
+        return 0;
+    }
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (timer_fd == -1) {
+        perror("timerfd_create");
+        return -1;
+    }
+
+    // Keep job control signals on the main thread
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    pthread_t tid;
+    int err = pthread_create(&tid, NULL, timer_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0) {
+        errno = err;
+        perror("pthread_create");
+        close(timer_fd);
+        timer_fd = -1;
+        return -1;
+    }
+    pthread_detach(tid);
+
+    return 0;
+}
+
+// Start timing a process group
+int timer_add(pid_t pgid, const timeout_spec *spec) {
+    if (timer_init() == -1) {
+        return -1;
+    }
+    pthread_mutex_lock(&timer_lock);
+    if (num_timers == MAX_JOBS) {
+        pthread_mutex_unlock(&timer_lock);
+        printf("timeout: too many timed jobs\n");
+        return -1;
+    }
+    timer_entry *t = &timers[num_timers++];
+    t->pgid = pgid;
+    t->spec = *spec;
+    t->fired = 0;
+    t->deadline = deadline_after(spec->duration);
+    timer_rearm();
+    pthread_mutex_unlock(&timer_lock);
+
+    return 0;
+}
+
+// Stop timing a process group once it has been reaped. Returns 1 if it timed out
+int timer_remove(pid_t pgid) {
+    int fired = 0;
+
+    if (timer_fd == -1) {
+        return 0;
+    }
+    pthread_mutex_lock(&timer_lock);
+    for (int i = 0; i < num_timers; i++) {
+        if (timers[i].pgid == pgid) {
+            fired = timers[i].fired != 0;
+            timers[i] = timers[--num_timers];
+            timer_rearm();
+            break;
+        }
+    }
+    pthread_mutex_unlock(&timer_lock);
+
+    return fired;
+}
+
+// timeout built-in: timeout DURATION [--signal SIG] [--kill-after D] cmd...
+// Runs cmd (which may be a pipeline) and signals its process group when time runs out
+int timeout_builtin(char **args, int num_args) {
+    timeout_spec spec = { -1, SIGTERM, 0 };
+    int i = 1;
+
+    // Options may come before or after DURATION; the first arg after DURATION that isn't one starts the command
+    while (i < num_args) {
+        if (args[i][0] != '-' || i + 1 >= num_args) {
+            if (spec.duration >= 0) {
+                break;
+            }
+            spec.duration = parse_duration(args[i]);
+            if (spec.duration < 0) {
+                printf("timeout: invalid duration %s\n", args[i]);
+                return -1;
+            }
+            i++;
+            continue;
+        }
+        if (strcmp(args[i], "--signal") == 0 || strcmp(args[i], "-s") == 0) {
+            spec.sig = parse_signal(args[i + 1]);
+            if (spec.sig == -1) {
+                printf("timeout: invalid signal %s\n", args[i + 1]);
+                return -1;
+            }
+        } else if (strcmp(args[i], "--kill-after") == 0 || strcmp(args[i], "-k") == 0) {
+            spec.kill_after = parse_duration(args[i + 1]);
+            if (spec.kill_after < 0) {
+                printf("timeout: invalid duration %s\n", args[i + 1]);
+                return -1;
+            }
+        } else {
+            printf("timeout: invalid option %s\n", args[i]);
+            return -1;
+        }
+        i += 2;
+    }
+    if (spec.duration < 0 || i >= num_args) {
+        printf("timeout: usage: timeout DURATION [--signal SIG] [--kill-after D] cmd...\n");
+        return -1;
+    }
+    if (spec.duration == 0) { // Zero disables the timeout, like coreutils
+        return execLine(args + i, num_args - i);
+    }
+
+    timeout_spec saved = cmd_timeout;
+    cmd_timeout = spec;
+    int ret = execLine(args + i, num_args - i);
+    cmd_timeout = saved;
+
+    return ret;
+}
+
+// Class by name. Returns -1 if there is no such class
+int parse_prio(const char *str) {
+    for (int i = 0; i < NUM_PRIOS; i++) {
+        if (strcmp(str, prio_names[i]) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+// Put the calling child in a class before it execs. Interactive keeps whatever the
+// shell runs with, and the others only ever lower it, so none of this needs privileges
+void apply_prio(int cls) {
+    if (cls == PRIO_INTERACTIVE) {
+        return;
+    }
+    struct sched_param sp = { 0 };
+    int policy = sched_getscheduler(0);
+    if (policy != prio_policy[cls] && policy != SCHED_IDLE && sched_setscheduler(0, prio_policy[cls], &sp) == -1) {
+        perror("sched_setscheduler");
+    }
+    errno = 0;
+    int nice = getpriority(PRIO_PROCESS, 0);
+    if (errno == 0 && nice < prio_nice[cls] && setpriority(PRIO_PROCESS, 0, prio_nice[cls]) == -1) {
+        perror("setpriority");
+    }
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROC, 0, prio_io[cls]) == -1) {
+        perror("ioprio_set");
+    }
+}
+
+// prio built-in: prio [CLASS [cmd...]]
+// Runs cmd (which may be a pipeline) in CLASS, or without a command makes CLASS the shell default
+int prio_builtin(char **args, int num_args) {
+    if (num_args == 1) {
+        printf("%s\n", prio_names[default_prio]);
+        return 0;
+    }
+    int cls = parse_prio(args[1]);
+    if (cls == -1) {
+        printf("prio: unknown class %s (interactive, batch or idle)\n", args[1]);
+        return -1;
+    }
+    if (num_args == 2) {
+        default_prio = cls;
+        return 0;
+    }
+
+    int saved = cmd_prio;
+    cmd_prio = cls;
+    int ret = execLine(args + 2, num_args - 2);
+    cmd_prio = saved;
+
+    return ret;
+}
+
+// Rotate a spool's log: NAME.log becomes NAME.log.1, .1 becomes .2 and so on, and
+// the oldest beyond keep is overwritten. The next write starts a new log
+static void spool_rotate(spool *s) {
+    char from[PATH_MAX], to[PATH_MAX];
+
+    close(s->log);
+    s->log = -1;
+    for (int i = s->keep; i > 0; i--) {
+        if (i == 1) {
+            snprintf(from, sizeof(from), "%s", s->path);
+        } else {
+            snprintf(from, sizeof(from), "%s.%d", s->path, i - 1);
+        }
+        snprintf(to, sizeof(to), "%s.%d", s->path, i);
+        rename(from, to);
+    }
+}
+
+// Write out a spool's buffered output in as few writes as rotation allows. A log
+// that fills up is cut after its last whole line where there is one
+static void spool_flush(spool *s) {
+    size_t off = 0;
+
+    while (off < s->len) {
+        if (s->log == -1) {
+            s->log = open(s->path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+            s->size = 0;
+            if (s->log == -1) {
+                break; // Lost from the log, but still in the tail
+            }
+        }
+        size_t n = s->len - off;
+        int full = 0;
+        if (s->max > 0 && (off_t)n >= s->max - s->size) {
+            n = s->max - s->size;
+            char *nl = memrchr(s->buf + off, '\n', n);
+            if (nl != NULL) {
+                n = nl - (s->buf + off) + 1;
+            }
+            full = 1;
+        }
+        ssize_t w = write(s->log, s->buf + off, n);
+        if (w <= 0) {
+            break;
+        }
+        off += w;
+        s->size += w;
+        if (full && (size_t)w == n) {
+            spool_rotate(s);
+        }
+    }
+    s->len = 0;
+}
+
+// Keep the last SPOOL_TAIL bytes of output. Called with spool_lock held
+static void spool_tail(spool *s, const char *p, size_t n) {
+    if (n > SPOOL_TAIL) {
+        s->tail_pos += n - SPOOL_TAIL;
+        p += n - SPOOL_TAIL;
+        n = SPOOL_TAIL;
+    }
+    while (n > 0) {
+        size_t at = s->tail_pos % SPOOL_TAIL;
+        size_t chunk = SPOOL_TAIL - at < n ? SPOOL_TAIL - at : n;
+        memcpy(s->tail + at, p, chunk);
+        s->tail_pos += chunk;
+        p += chunk;
+        n -= chunk;
+    }
+}
+
+// Take what a job has written into its buffer, writing it out once the buffer is full
+static void spool_read(spool *s) {
+    if (s->buf == NULL && (s->buf = malloc(SPOOL_BATCH)) == NULL) {
+        perror("malloc");
+        return;
+    }
+    ssize_t n = read(s->fd, s->buf + s->len, SPOOL_BATCH - s->len);
+    if (n > 0) {
+        if (s->len == 0) {
+            clock_gettime(CLOCK_MONOTONIC, &s->first);
+        }
+        pthread_mutex_lock(&spool_lock);
+        spool_tail(s, s->buf + s->len, n);
+        pthread_mutex_unlock(&spool_lock);
+        s->len += n;
+        if (s->len == SPOOL_BATCH) {
+            spool_flush(s);
+        }
+        return;
+    }
+    if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+
+    // At EOF the job and everything it started have closed the pipe
+    spool_flush(s);
+    close(s->fd);
+    s->fd = -1;
+    if (s->log != -1) {
+        close(s->log);
+        s->log = -1;
+    }
+    free(s->buf);
+    s->buf = NULL;
+    pthread_mutex_lock(&spool_lock);
+    s->done = 1;
+    pthread_mutex_unlock(&spool_lock);
+}
+
+// Move spools handed over by the shell into the table, dropping the oldest finished
+// ones to make room. Called by the writer with spool_lock held
+static void spool_adopt() {
+    while (spool_pending != NULL) {
+        if (num_spools == MAX_SPOOLS) {
+            int i = 0;
+            while (i < num_spools && !spools[i]->done) {
+                i++;
+            }
+            if (i == num_spools) {
+                return; // All live. The rest wait, and their jobs block, until one finishes
+            }
+            free(spools[i]->path);
+            free(spools[i]);
+            memmove(&spools[i], &spools[i + 1], (num_spools - i - 1) * sizeof(spool *));
+            num_spools--;
+        }
+        spool *s = spool_pending;
+        spool_pending = s->next;
+        if (spool_pending == NULL) {
+            spool_pending_end = &spool_pending;
+        }
+        spools[num_spools++] = s;
+    }
+}
+
+// Writer thread: drains every spooled job's pipe, batching output per job until the
+// buffer fills, the job finishes or the oldest byte has waited SPOOL_FLUSH_MS
+static void *spool_thread(void *arg) {
+    struct pollfd pfd[MAX_SPOOLS + 1];
+    spool *polled[MAX_SPOOLS + 1];
+    struct timespec now;
+    (void)arg;
+
+    for (;;) {
+        pthread_mutex_lock(&spool_lock);
+        spool_adopt();
+        int live = spool_pending != NULL;
+        for (int i = 0; i < num_spools; i++) {
+            live |= !spools[i]->done;
+        }
+        if (spool_stop || (spool_detached && !live)) {
+            for (int i = 0; i < num_spools; i++) {
+                if (spools[i]->len > 0) {
+                    spool_flush(spools[i]); // Only a memory copy left to the shell, so quick to wait for
+                }
+            }
+            spool_stopped = 1;
+            pthread_cond_broadcast(&spool_idle);
+            pthread_mutex_unlock(&spool_lock);
+            return NULL;
+        }
+        pthread_mutex_unlock(&spool_lock);
+
+        int n = 0, timeout = -1;
+        pfd[n++] = (struct pollfd){ spool_wake, POLLIN, 0 };
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        for (int i = 0; i < num_spools; i++) {
+            spool *s = spools[i];
+            if (s->fd != -1) {
+                polled[n] = s;
+                pfd[n++] = (struct pollfd){ s->fd, POLLIN, 0 };
+            }
+            if (s->len > 0) {
+                long waited = (now.tv_sec - s->first.tv_sec) * 1000 + (now.tv_nsec - s->first.tv_nsec) / 1000000;
+                long left = waited < SPOOL_FLUSH_MS ? SPOOL_FLUSH_MS - waited : 0;
+                if (timeout == -1 || left < timeout) {
+                    timeout = left;
+                }
+            }
+        }
+        if (poll(pfd, n, timeout) == -1 && errno != EINTR) {
+            perror("poll");
+            continue;
+        }
+        if (pfd[0].revents != 0) {
+            uint64_t v;
+            if (read(spool_wake, &v, sizeof(v)) == -1 && errno != EAGAIN) {
+                perror("read");
+            }
+        }
+        for (int i = 1; i < n; i++) {
+            if (pfd[i].revents != 0) {
+                spool_read(polled[i]);
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        for (int i = 0; i < num_spools; i++) {
+            spool *s = spools[i];
+            if (s->len > 0 && (now.tv_sec - s->first.tv_sec) * 1000
+                    + (now.tv_nsec - s->first.tv_nsec) / 1000000 >= SPOOL_FLUSH_MS) {
+                spool_flush(s);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// Start the writer thread on first use. Returns -1 on error
+static int spool_init() {
+    if (spool_wake != -1) {
+        return 0;
+    }
+    spool_wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (spool_wake == -1) {
+        perror("eventfd");
+        return -1;
+    }
+
+    // Keep job control signals on the main thread
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    pthread_t tid;
+    int err = pthread_create(&tid, NULL, spool_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0) {
+        errno = err;
+        perror("pthread_create");
+        close(spool_wake);
+        spool_wake = -1;
+        return -1;
+    }
+    pthread_detach(tid);
+
+    return 0;
+}
+
+// Output pipe for a background job when spooling is on. The read end is
+// non-blocking so the writer can poll it alongside the others
+static void spool_pipe(int out[2]) {
+    out[0] = out[1] = -1;
+    if (spool_dir == NULL) {
+        return;
+    }
+    if (pipe2(out, O_CLOEXEC) == -1) {
+        perror("pipe2");
+        out[0] = out[1] = -1;
+        return;
+    }
+    fcntl(out[0], F_SETFL, O_NONBLOCK);
+}
+
+// Hand a started job's output pipe to the writer, which opens DIR/NAME.PID.log on
+// its first write. Only memory and an eventfd poke, so the spawn never waits on the disk
+static void spool_add(int fd, pid_t pid, const char *name, int job_id) {
+    char path[PATH_MAX];
+    const char *base = strrchr(name, '/');
+
+    snprintf(path, sizeof(path), "%s/%s.%d.log", spool_dir, base != NULL ? base + 1 : name, (int)pid);
+    spool *s = calloc(1, sizeof(spool));
+    if (s == NULL || (s->path = strdup(path)) == NULL) {
+        perror("calloc");
+        free(s);
+        close(fd);
+        return;
+    }
+    s->fd = fd;
+    s->log = -1;
+    s->pid = pid;
+    s->job_id = job_id;
+    s->max = spool_max;
+    s->keep = spool_keep;
+
+    pthread_mutex_lock(&spool_lock);
+    *spool_pending_end = s;
+    spool_pending_end = &s->next;
+    pthread_mutex_unlock(&spool_lock);
+    uint64_t one = 1;
+    if (write(spool_wake, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        perror("write");
+    }
+}
+
+// Stop the writer when the shell exits, with everything buffered written out. Jobs
+// still writing outlive the shell, so a detached process takes over their pipes
+// rather than the exit waiting on them, or the jobs dying of a broken pipe
+static void spool_drain() {
+    if (spool_wake == -1) {
+        return;
+    }
+    pthread_mutex_lock(&spool_lock);
+    spool_stop = 1;
+    pthread_mutex_unlock(&spool_lock);
+    uint64_t one = 1;
+    if (write(spool_wake, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        perror("write");
+    }
+
+    pthread_mutex_lock(&spool_lock);
+    while (!spool_stopped) {
+        pthread_cond_wait(&spool_idle, &spool_lock);
+    }
+    int live = spool_pending != NULL;
+    for (int i = 0; i < num_spools; i++) {
+        live |= !spools[i]->done;
+    }
+    pthread_mutex_unlock(&spool_lock);
+    if (!live) {
+        return;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+    } else if (pid == 0) {
+        // Off the terminal, and off the shell's stdio so whoever reads it still sees EOF
+        setsid();
+        int null = open("/dev/null", O_RDWR);
+        for (int fd = 0; fd < 3 && null != -1; fd++) {
+            dup2(null, fd);
+        }
+        spool_stop = spool_stopped = 0;
+        spool_detached = 1;
+        spool_thread(NULL);
+        _exit(0);
+    }
+}
+
+// Print the in-memory tail of a job's output. It stays after the job finishes,
+// until the spool is dropped to make room
+int spool_print(int id) {
+    pid_t pid = 0;
+    char buf[SPOOL_TAIL];
+    size_t len = 0;
+    spool *found = NULL;
+
+    for (int i = 0; i < num_jobs; i++) {
+        if (jobs[i].id == id) {
+            pid = jobs[i].pid;
+        }
+    }
+    pthread_mutex_lock(&spool_lock);
+    // Newest first: the table, then the ones still waiting to join it
+    for (int i = 0; i < num_spools; i++) {
+        if (pid != 0 ? spools[i]->pid == pid : spools[i]->job_id == id) {
+            found = spools[i];
+        }
+    }
+    for (spool *s = spool_pending; s != NULL; s = s->next) {
+        if (pid != 0 ? s->pid == pid : s->job_id == id) {
+            found = s;
+        }
+    }
+    if (found != NULL) {
+        uint64_t start = found->tail_pos > SPOOL_TAIL ? found->tail_pos - SPOOL_TAIL : 0;
+        for (uint64_t p = start; p < found->tail_pos; p++) {
+            buf[len++] = found->tail[p % SPOOL_TAIL];
+        }
+    }
+    size_t skip = 0;
+    if (found != NULL && found->tail_pos > SPOOL_TAIL) { // Wrapped: start at the first whole line
+        char *nl = memchr(buf, '\n', len);
+        skip = nl != NULL ? (size_t)(nl - buf) + 1 : 0;
+    }
+    pthread_mutex_unlock(&spool_lock);
+
+    if (found == NULL) {
+        printf("jobs: no spooled output for job %d\n", id);
+        return -1;
+    }
+    fwrite(buf + skip, 1, len - skip, stdout);
+
+    return 0;
+}
+
+// spool built-in: spool [off | DIR [-s SIZE] [-k N]]
+// Sends the output of background jobs to DIR/NAME.PID.log, rotated at SIZE
+// (K, M or G suffix, 0 for never) with N old logs kept
+int spool_builtin(char **args, int num_args) {
+    if (num_args == 1) {
+        if (spool_dir == NULL) {
+            printf("off\n");
+        } else {
+            printf("%s size %lld keep %d\n", spool_dir, (long long)spool_max, spool_keep);
+        }
+        return 0;
+    }
+    if (strcmp(args[1], "off") == 0 && num_args == 2) {
+        free(spool_dir);
+        spool_dir = NULL;
+        return 0;
+    }
+
+    off_t max = SPOOL_SIZE;
+    int keep = SPOOL_KEEP;
+    for (int i = 2; i < num_args; i += 2) {
+        char *end;
+        errno = 0;
+        if (i + 1 >= num_args) {
+            printf("Usage: spool [off | DIR [-s SIZE] [-k N]]\n");
+            return -1;
+        } else if (strcmp(args[i], "-s") == 0) {
+            long long v;
+            if (parse_size(args[i + 1], &v) == -1) {
+                printf("spool: invalid size %s\n", args[i + 1]);
+                return -1;
+            }
+            max = v;
+        } else if (strcmp(args[i], "-k") == 0) {
+            long v = strtol(args[i + 1], &end, 10);
+            if (end == args[i + 1] || *end != '\0' || v < 0 || v > 99) {
+                printf("spool: invalid count %s\n", args[i + 1]);
+                return -1;
+            }
+            keep = v;
+        } else {
+            printf("Usage: spool [off | DIR [-s SIZE] [-k N]]\n");
+            return -1;
+        }
+    }
+
+    struct stat st;
+    if (stat(args[1], &st) == -1 || !S_ISDIR(st.st_mode)) {
+        printf("spool: %s is not a directory\n", args[1]);
+        return -1;
+    }
+    char *dir = strdup(args[1]);
+    if (dir == NULL) {
+        perror("strdup");
+        return -1;
+    }
+    if (spool_init() == -1) {
+        free(dir);
+        return -1;
+    }
+    free(spool_dir);
+    spool_dir = dir;
+    spool_max = max;
+    spool_keep = keep;
+
+    return 0;
+}
+
+// Open the history file on first use. Returns -1 if history is unavailable
+static int hist_open() {
+    if (hist.fd != -1) {
+        return 0;
+    }
+
+    char path[4096];
+    const char *file = var_get("WSH_HISTFILE");
+    if (file == NULL) {
+        const char *home = var_get("HOME");
+        if (home == NULL) {
+            return -1;
+        }
+        snprintf(path, sizeof(path), "%s/.wsh_history", home);
+        file = path;
+    }
+    // O_APPEND makes each record a single atomic append, even with other shells writing
+    hist.fd = open(file, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (hist.fd == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Append one record: start time, duration (ms), exit status and the command line
+void hist_add(const char *line, time_t start, long duration_ms, int status) {
+    if (hist_open() == -1) {
+        return;
+    }
+
+    size_t len = strlen(line);
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == ' ' || line[len - 1] == '\t')) {
+        len--;
+    }
+    if (len == 0) {
+        return;
+    }
+
+    char head[64];
+    int hlen = snprintf(head, sizeof(head), "%lld\t%ld\t%d\t", (long long)start, duration_ms, status);
+    char *rec = malloc(hlen + len + 1);
+    if (rec == NULL) {
+        return;
+    }
+    memcpy(rec, head, hlen);
+    memcpy(rec + hlen, line, len);
+    rec[hlen + len] = '\n';
+
+    // The lock keeps readers from indexing a record that is still being written
+    flock(hist.fd, LOCK_EX);
+    if (write(hist.fd, rec, hlen + len + 1) == -1) {
+        perror("history");
+    }
+    flock(hist.fd, LOCK_UN);
+    free(rec);
+}
+
+// Parse one tab-terminated number of a record. The map isn't NUL terminated, so stay before end
+static long hist_field(const char **p, const char *end) {
+    long v = 0;
+    int neg = *p < end && **p == '-';
+
+    *p += neg;
+    while (*p < end && **p >= '0' && **p <= '9') {
+        v = v * 10 + (**p - '0');
+        (*p)++;
+    }
+    if (*p < end && **p == '\t') {
+        (*p)++;
+    }
+
+    return neg ? -v : v;
+}
+
+// Map any records appended since the last call (by us or another shell) and index them
+static int hist_refresh() {
+    struct stat st;
+
+    if (hist_open() == -1) {
+        return -1;
+    }
+    flock(hist.fd, LOCK_SH);
+    if (fstat(hist.fd, &st) == -1) {
+        flock(hist.fd, LOCK_UN);
+        return -1;
+    }
+    size_t size = st.st_size;
+    if (size > hist.map_len) {
+        char *map = hist.map == NULL
+            ? mmap(NULL, size, PROT_READ, MAP_SHARED, hist.fd, 0)
+            : mremap(hist.map, hist.map_len, size, MREMAP_MAYMOVE);
+        if (map == MAP_FAILED) {
+            flock(hist.fd, LOCK_UN);
+            return -1;
+        }
+        hist.map = map;
+        hist.map_len = size;
+    }
+    flock(hist.fd, LOCK_UN);
+
+    // Index complete records past the end of the last refresh
+    const char *p = hist.map + hist.indexed;
+    const char *end = hist.map + hist.map_len;
+    const char *nl;
+    while (p < end && (nl = memchr(p, '\n', end - p)) != NULL) {
+        if (hist.num == hist.cap) {
+            size_t cap = hist.cap ? hist.cap * 2 : 4096;
+            hist_entry *e = realloc(hist.entries, cap * sizeof(hist_entry));
+            if (e == NULL) {
+                return -1;
+            }
+            hist.entries = e;
+            hist.cap = cap;
+        }
+        // Start time, duration and status, then the command
+        const char *cmd = p;
+        hist_entry *e = &hist.entries[hist.num++];
+        hist_field(&cmd, nl);
+        e->ms = hist_field(&cmd, nl);
+        e->status = hist_field(&cmd, nl);
+        e->rec = p - hist.map;
+        e->cmd = cmd - hist.map;
+        e->len = nl - cmd;
+        p = nl + 1;
+    }
+    hist.indexed = p - hist.map;
+
+    return 0;
+}
+
+// Compare two entries by command text, for the prefix index
+static int hist_cmp(const void *a, const void *b) {
+    const hist_entry *x = &hist.entries[*(const uint32_t *)a];
+    const hist_entry *y = &hist.entries[*(const uint32_t *)b];
+    size_t n = x->len < y->len ? x->len : y->len;
+    int c = memcmp(hist.map + x->cmd, hist.map + y->cmd, n);
+    if (c != 0) {
+        return c;
+    }
+    return (x->len > y->len) - (x->len < y->len);
+}
+
+// Bring the sorted prefix index up to date by sorting new entries and merging them in
+static int hist_sort() {
+    size_t old = hist.num_sorted;
+    size_t add = hist.num - old;
+
+    if (add == 0) {
+        return 0;
+    }
+    uint32_t *sorted = realloc(hist.sorted, hist.num * sizeof(uint32_t));
+    uint32_t *tmp = malloc(add * sizeof(uint32_t));
+    if (sorted == NULL || tmp == NULL) {
+        free(tmp);
+        if (sorted != NULL) {
+            hist.sorted = sorted;
+        }
+        return -1;
+    }
+    hist.sorted = sorted;
+    for (size_t i = 0; i < add; i++) {
+        tmp[i] = old + i;
+    }
+    qsort(tmp, add, sizeof(uint32_t), hist_cmp);
+
+    // Merge from the back so it can be done in place
+    size_t i = old, j = add, k = hist.num;
+    while (j > 0) {
+        if (i > 0 && hist_cmp(&sorted[i - 1], &tmp[j - 1]) > 0) {
+            sorted[--k] = sorted[--i];
+        } else {
+            sorted[--k] = tmp[--j];
+        }
+    }
+    free(tmp);
+    hist.num_sorted = hist.num;
+
+    return 0;
+}
+
+// Print one history entry with its number, duration and exit status
+static void hist_print(size_t i) {
+    const hist_entry *e = &hist.entries[i];
+    printf("%7zu  %8.3fs  %3d  %.*s\n", i + 1, e->ms / 1000.0, e->status, (int)e->len, hist.map + e->cmd);
+}
+
+// history built-in:
+//   history [N]        last N entries (default 20)
+//   history -p PREFIX  entries starting with PREFIX
+//   history -s TEXT    entries containing TEXT
+//   history -t [N]     N slowest entries (default 10)
+int history_builtin(char **args, int num_args) {
+    if (hist_refresh() == -1) {
+        printf("history: not available\n");
+        return -1;
+    }
+
+    if (num_args == 3 && strcmp(args[1], "-p") == 0) {
+        if (hist_sort() == -1) {
+            perror("history");
+            return -1;
+        }
+        // Binary search for the first entry >= PREFIX, then walk while it still matches
+        size_t plen = strlen(args[2]);
+        size_t lo = 0, hi = hist.num;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            const hist_entry *e = &hist.entries[hist.sorted[mid]];
+            size_t n = e->len < plen ? e->len : plen;
+            int c = memcmp(hist.map + e->cmd, args[2], n);
+            if (c < 0 || (c == 0 && e->len < plen)) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        for (; lo < hist.num; lo++) {
+            const hist_entry *e = &hist.entries[hist.sorted[lo]];
+            if (e->len < plen || memcmp(hist.map + e->cmd, args[2], plen) != 0) {
+                break;
+            }
+            hist_print(hist.sorted[lo]);
+        }
+        return 0;
+    } else if (num_args == 3 && strcmp(args[1], "-s") == 0) {
+        // One memmem pass over the whole log; each hit is mapped back to its entry
+        size_t nlen = strlen(args[2]);
+        const char *base = hist.map;
+        const char *p = base;
+        const char *end = base + hist.indexed;
+        size_t e = 0;
+        while (nlen > 0 && (p = memmem(p, end - p, args[2], nlen)) != NULL) {
+            size_t off = p - base;
+            size_t lo = e, hi = hist.num;
+            while (hi - lo > 1) { // Last entry whose record starts at or before off
+                size_t mid = lo + (hi - lo) / 2;
+                if (hist.entries[mid].rec <= off) {
+                    lo = mid;
+                } else {
+                    hi = mid;
+                }
+            }
+            e = lo;
+            const hist_entry *h = &hist.entries[e];
+            if (off >= h->cmd && off + nlen <= h->cmd + h->len) { // Hit is in the command, not the header
+                hist_print(e);
+                p = base + h->cmd + h->len; // One line per entry
+            } else {
+                p++;
+            }
+        }
+        return 0;
+    } else if (num_args >= 2 && strcmp(args[1], "-t") == 0) {
+        size_t n = num_args == 3 ? (size_t)atol(args[2]) : 10;
+        if (n > hist.num) {
+            n = hist.num;
+        }
+        // Keep the n slowest seen so far in a small sorted array
+        size_t *top = malloc((n + 1) * sizeof(size_t));
+        long *dur = malloc((n + 1) * sizeof(long));
+        size_t count = 0;
+        if (top == NULL || dur == NULL) {
+            free(top);
+            free(dur);
+            return -1;
+        }
+        for (size_t i = 0; i < hist.num && n > 0; i++) {
+            long d = hist.entries[i].ms;
+            if (count == n && d <= dur[count - 1]) {
+                continue;
+            }
+            size_t k = count < n ? count++ : count - 1;
+            while (k > 0 && dur[k - 1] < d) {
+                dur[k] = dur[k - 1];
+                top[k] = top[k - 1];
+                k--;
+            }
+            dur[k] = d;
+            top[k] = i;
+        }
+        for (size_t i = 0; i < count; i++) {
+            hist_print(top[i]);
+        }
+        free(top);
+        free(dur);
+        return 0;
+    } else if (num_args <= 2 && (num_args == 1 || args[1][0] != '-')) {
+        size_t n = num_args == 2 ? (size_t)atol(args[1]) : 20;
+        size_t i = hist.num > n ? hist.num - n : 0;
+        for (; i < hist.num; i++) {
+            hist_print(i);
+        }
+        return 0;
+    }
+
+    printf("history: usage: history [N] | -p PREFIX | -s TEXT | -t [N]\n");
+    return -1;
+}
+
+// Read a whole directory with large getdents64 batches. Returns -1 on error
+int read_dir(const char *path, dir_listing *out) {
+    struct stat st;
+    char buf[64 * 1024];
+    size_t used = 0, cap = 0;
+
+    memset(out, 0, sizeof(*out));
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return -1;
+    }
+    out->mtime = st.st_mtim;
+
+    while (1) {
+        long n = syscall(SYS_getdents64, fd, buf, sizeof(buf));
+        if (n <= 0) {
+            break;
+        }
+        for (long pos = 0; pos < n;) {
+            struct dirent64 *d = (struct dirent64 *)(buf + pos);
+            pos += d->d_reclen;
+            if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0) {
+                continue;
+            }
+            size_t len = strlen(d->d_name) + 1;
+            if (out->num % 256 == 0) { // Grow offsets and types together
+                size_t *offs = realloc(out->offs, (out->num + 256) * sizeof(size_t));
+                unsigned char *types = offs ? realloc(out->types, out->num + 256) : NULL;
+                if (offs != NULL) {
+                    out->offs = offs;
+                }
+                if (types == NULL) {
+                    break;
+                }
+                out->types = types;
+            }
+            if (used + len > cap) {
+                cap = cap ? cap * 2 : 16 * 1024;
+                while (used + len > cap) {
+                    cap *= 2;
+                }
+                char *names = realloc(out->names, cap);
+                if (names == NULL) {
+                    break;
+                }
+                out->names = names;
+            }
+            memcpy(out->names + used, d->d_name, len);
+            out->offs[out->num] = used;
+            out->types[out->num] = d->d_type;
+            out->num++;
+            used += len;
+        }
+    }
+    close(fd);
+
+    return 0;
+}
+
+void free_dir(dir_listing *dl) {
+    free(dl->path);
+    free(dl->names);
+    free(dl->offs);
+    free(dl->types);
+    memset(dl, 0, sizeof(*dl));
+}
+
+// Command trie, filled in by a background thread from the PATH directories
+static trie_node comp_root;
+static pthread_mutex_t comp_lock = PTHREAD_MUTEX_INITIALIZER;
+static int comp_running = 0; // A refresh thread is scanning
+static time_t comp_checked = 0; // Last time the PATH mtimes were checked
+static char *comp_path = NULL; // PATH the trie was built from
+static dir_listing *comp_dirs = NULL; // Executables per PATH directory
+static size_t comp_num_dirs = 0;
+
+// Built-ins from execute(), always completable
+static const char *builtin_names[] = { "bg", "break", "cat", "cd", "continue", "coproc", "exit", "export", "false", "fg", "head", "history", "jobs", "limit", "prio", "recv", "send", "set", "spool", "timeout", "true", "unset", "wait", "wc", NULL };
+
+// Add delta to the count of name in the trie. Caller holds comp_lock
+static void trie_add(const char *name, int delta) {
+    trie_node *node = &comp_root;
+
+    for (; *name; name++) {
+        trie_node **link = &node->child;
+        while (*link != NULL && (*link)->c < *name) { // Siblings stay sorted
+            link = &(*link)->next;
+        }
+        if (*link == NULL || (*link)->c != *name) {
+            if (delta < 0) {
+                return;
+            }
+            trie_node *n = calloc(1, sizeof(trie_node));
+            if (n == NULL) {
+                return;
+            }
+            n->c = *name;
+            n->next = *link;
+            *link = n;
+        }
+        node = *link;
+    }
+    node->count += delta;
+}
+
+// Add or remove every executable in a directory listing. Caller holds comp_lock
+static void trie_add_dir(const dir_listing *dl, int delta) {
+    for (size_t i = 0; i < dl->num; i++) {
+        if (dl->types[i] != DT_UNKNOWN) { // Non-executables are marked DT_UNKNOWN
+            trie_add(dl->names + dl->offs[i], delta);
+        }
+    }
+}
+
+// Background refresh: rescan PATH directories whose mtime changed
+static void *comp_thread(void *arg) {
+    char *path = arg;
+    size_t num = 0;
+    dir_listing *dirs = NULL;
+
+    // Split PATH, reusing listings from the last scan when the directory hasn't changed
+    for (char *save = NULL, *dir = strtok_r(path, ":", &save); dir != NULL; dir = strtok_r(NULL, ":", &save)) {
+        dir_listing *d = realloc(dirs, (num + 1) * sizeof(dir_listing));
+        if (d == NULL) {
+            break;
+        }
+        dirs = d;
+        dir_listing *dl = &dirs[num++];
+        memset(dl, 0, sizeof(*dl));
+
+        struct stat st;
+        size_t j;
+        pthread_mutex_lock(&comp_lock);
+        for (j = 0; j < comp_num_dirs; j++) {
+            if (comp_dirs[j].path != NULL && strcmp(comp_dirs[j].path, dir) == 0) {
+                break;
+            }
+        }
+        if (j < comp_num_dirs && stat(dir, &st) == 0
+                && st.st_mtim.tv_sec == comp_dirs[j].mtime.tv_sec && st.st_mtim.tv_nsec == comp_dirs[j].mtime.tv_nsec) {
+            *dl = comp_dirs[j]; // Unchanged, take over the old listing
+            memset(&comp_dirs[j], 0, sizeof(dir_listing));
+            pthread_mutex_unlock(&comp_lock);
+            continue;
+        }
+        pthread_mutex_unlock(&comp_lock);
+
+        // New or changed: read it outside the lock and keep only executables
+        if (read_dir(dir, dl) == -1) {
+            dl->path = strdup(dir);
+            continue;
+        }
+        dl->path = strdup(dir);
+        int dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        for (size_t i = 0; i < dl->num; i++) {
+            int isfile = dl->types[i] == DT_REG || dl->types[i] == DT_LNK || dl->types[i] == DT_UNKNOWN;
+            if (!isfile || faccessat(dfd, dl->names + dl->offs[i], X_OK, 0) != 0) {
+                dl->types[i] = DT_UNKNOWN;
+            } else if (dl->types[i] == DT_UNKNOWN) {
+                dl->types[i] = DT_REG;
+            }
+        }
+        if (dfd != -1) {
+            close(dfd);
+        }
+        pthread_mutex_lock(&comp_lock);
+        trie_add_dir(dl, 1);
+        pthread_mutex_unlock(&comp_lock);
+    }
+
+    // Whatever is left of the old scan is gone from PATH or was replaced
+    pthread_mutex_lock(&comp_lock);
+    for (size_t j = 0; j < comp_num_dirs; j++) {
+        if (comp_dirs[j].path != NULL) {
+            trie_add_dir(&comp_dirs[j], -1);
+        }
+        free_dir(&comp_dirs[j]);
+    }
+    free(comp_dirs);
+    comp_dirs = dirs;
+    comp_num_dirs = num;
+    comp_running = 0;
+    pthread_mutex_unlock(&comp_lock);
+    free(path);
+
+    return NULL;
+}
+
+// Start a background refresh of the command trie when PATH or one of its directories changed.
+// Checked at most once a second, so keypresses never wait on the filesystem
+static void comp_refresh() {
+    time_t now = time(NULL);
+    const char *path = var_get("PATH");
+
+    if (path == NULL) {
+        path = "/usr/bin:/bin";
+    }
+    pthread_mutex_lock(&comp_lock);
+    if (comp_running || now == comp_checked) {
+        pthread_mutex_unlock(&comp_lock);
+        return;
+    }
+    comp_checked = now;
+
+    int changed = comp_path == NULL || strcmp(comp_path, path) != 0;
+    if (comp_path == NULL) { // First use
+        for (int i = 0; builtin_names[i] != NULL; i++) {
+            trie_add(builtin_names[i], 1);
+        }
+    }
+    for (size_t j = 0; j < comp_num_dirs && !changed; j++) {
+        struct stat st;
+        changed = stat(comp_dirs[j].path, &st) == -1 || st.st_mtim.tv_sec != comp_dirs[j].mtime.tv_sec
+            || st.st_mtim.tv_nsec != comp_dirs[j].mtime.tv_nsec;
+    }
+    if (!changed) {
+        pthread_mutex_unlock(&comp_lock);
+        return;
+    }
+    free(comp_path);
+    comp_path = strdup(path);
+    char *arg = strdup(path);
+    if (comp_path == NULL || arg == NULL) {
+        free(arg);
+        pthread_mutex_unlock(&comp_lock);
+        return;
+    }
+
+    // Keep job control signals on the main thread
+    sigset_t all, old;
+    pthread_t tid;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    if (pthread_create(&tid, NULL, comp_thread, arg) == 0) {
+        pthread_detach(tid);
+        comp_running = 1;
+    } else {
+        free(arg);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_mutex_unlock(&comp_lock);
+}
+
+// Append a match to the list
+static void add_match(matches *m, const char *name, char suffix) {
+    if (m->num == m->cap) {
+        size_t cap = m->cap ? m->cap * 2 : 64;
+        char **v = realloc(m->v, cap * sizeof(char *));
+        char *s = v ? realloc(m->suffix, cap) : NULL;
+        if (v != NULL) {
+            m->v = v;
+        }
+        if (s == NULL) {
+            return;
+        }
+        m->suffix = s;
+        m->cap = cap;
+    }
+    m->v[m->num] = strdup(name);
+    if (m->v[m->num] != NULL) {
+        m->suffix[m->num++] = suffix;
+    }
+}
+
+static void free_matches(matches *m) {
+    for (size_t i = 0; i < m->num; i++) {
+        free(m->v[i]);
+    }
+    free(m->v);
+    free(m->suffix);
+}
+
+// Collect every command under node, depth first so they come out sorted. Caller holds comp_lock
+static void trie_collect(const trie_node *node, char *name, size_t len, matches *m) {
+    for (; node != NULL; node = node->next) {
+        if (len + 1 >= 256) {
+            continue;
+        }
+        name[len] = node->c;
+        name[len + 1] = '\0';
+        if (node->count > 0) {
+            add_match(m, name, ' ');
+        }
+        trie_collect(node->child, name, len + 1, m);
+    }
+}
+
+// Commands starting with prefix
+static void complete_command(const char *prefix, matches *m) {
+    char name[256];
+    trie_node *node = &comp_root;
+
+    comp_refresh();
+    pthread_mutex_lock(&comp_lock);
+    for (const char *p = prefix; *p && node != NULL; p++) {
+        node = node->child;
+        while (node != NULL && node->c != *p) {
+            node = node->next;
+        }
+    }
+    if (node != NULL && strlen(prefix) < sizeof(name)) {
+        strcpy(name, prefix);
+        if (node != &comp_root && node->count > 0) {
+            add_match(m, name, ' ');
+        }
+        trie_collect(node->child, name, strlen(name), m);
+    }
+    pthread_mutex_unlock(&comp_lock);
+}
+
+// Directory listings for filename completion, reused while the directory's mtime is unchanged
+static dir_listing file_cache[16];
+static int file_cache_next = 0;
+
+static const dir_listing *cached_dir(const char *path) {
+    struct stat st;
+
+    if (stat(path, &st) == -1) {
+        return NULL;
+    }
+    for (int i = 0; i < 16; i++) {
+        dir_listing *dl = &file_cache[i];
+        if (dl->path != NULL && strcmp(dl->path, path) == 0) {
+            if (dl->mtime.tv_sec == st.st_mtim.tv_sec && dl->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+                return dl;
+            }
+            free_dir(dl);
+            break;
+        }
+    }
+
+    // Not cached or stale, so replace the oldest entry
+    dir_listing *dl = &file_cache[file_cache_next];
+    file_cache_next = (file_cache_next + 1) % 16;
+    free_dir(dl);
+    if (read_dir(path, dl) == -1) {
+        return NULL;
+    }
+    dl->path = strdup(path);
+
+    return dl;
+}
+
+// Files whose path starts with word
+static void complete_file(const char *word, matches *m) {
+    const char *slash = strrchr(word, '/');
+    const char *base = slash ? slash + 1 : word;
+    size_t dlen = slash ? (size_t)(slash - word) + 1 : 0;
+    char dir[4096];
+
+    if (dlen >= sizeof(dir)) {
+        return;
+    }
+    if (dlen == 0) {
+        strcpy(dir, ".");
+    } else {
+        memcpy(dir, word, dlen);
+        dir[dlen] = '\0';
+    }
+    const dir_listing *dl = cached_dir(dir);
+    if (dl == NULL) {
+        return;
+    }
+
+    size_t blen = strlen(base);
+    char full[8192];
+    for (size_t i = 0; i < dl->num; i++) {
+        const char *name = dl->names + dl->offs[i];
+        if (strncmp(name, base, blen) != 0 || (name[0] == '.' && base[0] != '.')) {
+            continue;
+        }
+        int isdir = dl->types[i] == DT_DIR;
+        if (dl->types[i] == DT_LNK || dl->types[i] == DT_UNKNOWN) { // Follow it to see if it's a directory
+            struct stat st;
+            snprintf(full, sizeof(full), "%s/%s", dir, name);
+            isdir = stat(full, &st) == 0 && S_ISDIR(st.st_mode);
+        }
+        snprintf(full, sizeof(full), "%.*s%s", (int)dlen, word, name);
+        add_match(m, full, isdir ? '/' : ' ');
+    }
+}
+
+static int match_cmp(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Line being edited
+static char *ed_buf = NULL;
+static size_t ed_len = 0, ed_cap = 0;
+
+// Insert text at the end of the line and echo it
+static void ed_insert(const char *text, size_t n) {
+    if (ed_len + n + 2 > ed_cap) {
+        size_t cap = ed_cap ? ed_cap * 2 : 256;
+        while (ed_len + n + 2 > cap) {
+            cap *= 2;
+        }
+        char *b = realloc(ed_buf, cap);
+        if (b == NULL) {
+            return;
+        }
+        ed_buf = b;
+        ed_cap = cap;
+    }
+    memcpy(ed_buf + ed_len, text, n);
+    ed_len += n;
+    if (write(STDOUT_FILENO, text, n) == -1) {
+        return;
+    }
+}
+
+// Complete the word before the cursor. The first tab extends to the longest
+// common prefix; a second tab in a row lists the candidates
+static void ed_complete(int tabs) {
+    size_t start = ed_len;
+    while (start > 0 && ed_buf[start - 1] != ' ' && ed_buf[start - 1] != '\t' && ed_buf[start - 1] != '|' && ed_buf[start - 1] != ';') {
+        start--;
+    }
+    size_t before = start; // Command position if only separators come before the word
+    while (before > 0 && (ed_buf[before - 1] == ' ' || ed_buf[before - 1] == '\t')) {
+        before--;
+    }
+    int is_cmd = before == 0 || ed_buf[before - 1] == '|' || ed_buf[before - 1] == ';' || ed_buf[before - 1] == '&';
+
+    char word[4096];
+    size_t wlen = ed_len - start;
+    if (wlen >= sizeof(word)) {
+        return;
+    }
+    memcpy(word, ed_buf + start, wlen);
+    word[wlen] = '\0';
+
+    matches m = { NULL, NULL, 0, 0 };
+    if (is_cmd && strchr(word, '/') == NULL) {
+        complete_command(word, &m);
+    } else {
+        complete_file(word, &m);
+    }
+    if (m.num == 0) {
+        free_matches(&m);
+        return;
+    }
+
+    // Longest common prefix of all matches
+    size_t lcp = strlen(m.v[0]);
+    for (size_t i = 1; i < m.num; i++) {
+        size_t j = 0;
+        while (j < lcp && m.v[i][j] == m.v[0][j]) {
+            j++;
+        }
+        lcp = j;
+    }
+    if (lcp > wlen) {
+        ed_insert(m.v[0] + wlen, lcp - wlen);
+    }
+    if (m.num == 1) {
+        ed_insert(&m.suffix[0], 1);
+    } else if (lcp == wlen && tabs > 1) {
+        qsort(m.v, m.num, sizeof(char *), match_cmp);
+        printf("\n");
+        for (size_t i = 0; i < m.num && i < 200; i++) {
+            printf("%s  ", m.v[i] + (strrchr(word, '/') ? (size_t)(strrchr(word, '/') - word) + 1 : 0));
+        }
+        if (m.num > 200) {
+            printf("... (%zu more)", m.num - 200);
+        }
+        printf("\n%s%.*s", PROMPT, (int)ed_len, ed_buf);
+    }
+    free_matches(&m);
+}
+
+// Read a line of input. On a terminal this does its own editing with tab
+// completion; otherwise it is a plain getline. Returns -1 at end of input
+ssize_t read_line(char **buffer, size_t *bufsize) {
+    struct termios old, raw;
+
+    if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &old) == -1) {
+        return getline(buffer, bufsize, stdin);
+    }
+    raw = old;
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG); // ^C and ^D are handled here
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+    ssize_t ret = 0;
+    int tabs = 0;
+    ed_len = 0;
+    while (1) {
+        char c;
+        ssize_t n = read(STDIN_FILENO, &c, 1);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0 || (c == 4 && ed_len == 0)) { // ^D on an empty line
+            ret = -1;
+            break;
+        }
+        tabs = c == '\t' ? tabs + 1 : 0;
+        if (c == '\r' || c == '\n') {
+            ed_insert("\n", 1);
+            break;
+        } else if (c == '\t') {
+            ed_complete(tabs);
+        } else if (c == 3) { // ^C drops the line
+            printf("^C\n%s", PROMPT);
+            ed_len = 0;
+        } else if (c == 127 || c == 8) {
+            if (ed_len > 0) {
+                ed_len--;
+                printf("\b \b");
+            }
+        } else if (c == 21) { // ^U
+            for (; ed_len > 0; ed_len--) {
+                printf("\b \b");
+            }
+        } else if (c == 27) { // Skip escape sequences such as arrow keys
+            // A lone ESC has nothing after it, so wait only briefly for each byte
+            struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+            char seq = 0;
+            int csi = 0;
+            while (poll(&pfd, 1, 50) == 1 && read(STDIN_FILENO, &seq, 1) == 1) {
+                if (csi == 0 && (seq == '[' || seq == 'O')) {
+                    csi = seq == '[' ? 1 : 2;
+                } else if (csi != 1 || (seq >= 0x40 && seq <= 0x7e)) {
+                    break; // ESC x, ESC O x or the final byte of ESC [ ... x
+                }
+            }
+        } else if ((unsigned char)c >= 32) {
+            ed_insert(&c, 1);
+        }
+    }
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &old);
+
+    if (ret == -1) {
+        return -1;
+    }
+    // Hand the line back the way getline would
+    if (*bufsize < ed_len + 1) {
+        char *b = realloc(*buffer, ed_len + 1);
+        if (b == NULL) {
+            return -1;
+        }
+        *buffer = b;
+        *bufsize = ed_len + 1;
+    }
+    memcpy(*buffer, ed_buf, ed_len);
+    (*buffer)[ed_len] = '\0';
+
+    return ed_len;
+}
+
+// Hash of a variable name (FNV-1a)
+static unsigned var_hash(const char *name, size_t len) {
+    unsigned h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return h;
+}
+
+// Whether name[0..len) is a valid variable name
+int var_name_ok(const char *name, size_t len) {
+    if (len == 0 || (name[0] >= '0' && name[0] <= '9')) {
+        return 0;
+    }
+    for (size_t i = 0; i < len; i++) {
+        char c = name[i];
+        if (!(c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Find a variable by name. Returns NULL if it isn't set
+static var *var_find(const char *name, size_t len) {
+    vars_init();
+    for (var *v = vars.buckets[var_hash(name, len) & (vars.num_buckets - 1)]; v != NULL; v = v->next) {
+        if (v->name_len == len && strncmp(v->entry, name, len) == 0) {
+            return v;
+        }
+    }
+    return NULL;
+}
+
+// Double the table once it averages more than one variable per bucket
+static void vars_grow() {
+    size_t n = vars.num_buckets * 2;
+    var **b = calloc(n, sizeof(var *));
+    if (b == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < vars.num_buckets; i++) {
+        for (var *v = vars.buckets[i], *next; v != NULL; v = next) {
+            next = v->next;
+            size_t h = var_hash(v->entry, v->name_len) & (n - 1);
+            v->next = b[h];
+            b[h] = v;
+        }
+    }
+    free(vars.buckets);
+    vars.buckets = b;
+    vars.num_buckets = n;
+}
+
+// Set a variable. exported is 1 to export, 0 to keep it as it is, -1 to stop exporting.
+// Returns -1 on error
+int var_set(const char *name, size_t len, const char *value, int exported) {
+    if (!var_name_ok(name, len)) {
+        return -1;
+    }
+    var *v = var_find(name, len);
+    if (v == NULL) {
+        v = calloc(1, sizeof(var));
+        if (v == NULL) {
+            return -1;
+        }
+        size_t h = var_hash(name, len) & (vars.num_buckets - 1);
+        v->name_len = len;
+        v->next = vars.buckets[h];
+        vars.buckets[h] = v;
+        vars.num++;
+    }
+
+    // Stored as NAME=value so the exported ones can go straight into envp
+    if (value != NULL) {
+        size_t vlen = strlen(value);
+        char *entry = malloc(len + vlen + 2);
+        if (entry == NULL) {
+            return -1;
+        }
+        memcpy(entry, name, len);
+        entry[len] = '=';
+        memcpy(entry + len + 1, value, vlen + 1);
+        free(v->entry);
+        v->entry = entry;
+    } else if (v->entry == NULL) { // export NAME of an unset variable
+        v->entry = malloc(len + 2);
+        if (v->entry == NULL) {
+            return -1;
+        }
+        memcpy(v->entry, name, len);
+        strcpy(v->entry + len, "=");
+    }
+
+    int was = v->exported;
+    if (exported != 0) {
+        v->exported = exported > 0;
+    }
+    if (v->exported || was) {
+        vars.env_dirty = 1;
+    }
+    if (vars.num > vars.num_buckets) {
+        vars_grow();
+    }
+
+    return 0;
+}
+
+// Get a variable's value, or NULL if it isn't set
+const char *var_get(const char *name) {
+    var *v = var_find(name, strlen(name));
+    return v ? v->entry + v->name_len + 1 : NULL;
+}
+
+// Remove a variable
+void var_unset(const char *name) {
+    size_t len = strlen(name);
+
+    vars_init();
+    for (var **link = &vars.buckets[var_hash(name, len) & (vars.num_buckets - 1)]; *link != NULL; link = &(*link)->next) {
+        var *v = *link;
+        if (v->name_len == len && strncmp(v->entry, name, len) == 0) {
+            *link = v->next;
+            if (v->exported) {
+                vars.env_dirty = 1;
+            }
+            free(v->entry);
+            free(v);
+            vars.num--;
+            return;
+        }
+    }
+}
+
+// Import the inherited environment on first use
+void vars_init() {
+    if (vars.buckets != NULL) {
+        return;
+    }
+    vars.num_buckets = 64;
+    vars.buckets = calloc(vars.num_buckets, sizeof(var *));
+    if (vars.buckets == NULL) {
+        perror("vars");
+        exit(-1);
+    }
+    for (char **e = environ; *e != NULL; e++) {
+        char *eq = strchr(*e, '=');
+        if (eq != NULL) {
+            var_set(*e, eq - *e, eq + 1, 1);
+        }
+    }
+    vars.env_dirty = 1;
+}
+
+// Environment for children. Rebuilt only after an exported variable changed;
+// until the store is first touched it is just the inherited environ
+char **var_envp() {
+    if (vars.buckets == NULL) {
+        return environ;
+    }
+    if (!vars.env_dirty) {
+        return vars.envp;
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < vars.num_buckets; i++) {
+        for (var *v = vars.buckets[i]; v != NULL; v = v->next) {
+            n += v->exported;
+        }
+    }
+    char **envp = realloc(vars.envp, (n + 1) * sizeof(char *));
+    if (envp == NULL) {
+        return vars.envp ? vars.envp : environ;
+    }
+    n = 0;
+    for (size_t i = 0; i < vars.num_buckets; i++) {
+        for (var *v = vars.buckets[i]; v != NULL; v = v->next) {
+            if (v->exported) {
+                envp[n++] = v->entry;
+            }
+        }
+    }
+    envp[n] = NULL;
+    vars.envp = envp;
+    vars.env_dirty = 0;
+
+    return envp;
+}
+
+// Value of the expansion at p ($NAME, ${NAME}, $? or $$), setting *next past it.
+// num is scratch space for numeric values. Returns NULL if p isn't an expansion
+const char *var_value(const char *p, const char **next, char *num) {
+    if (p[0] != '$') {
+        return NULL;
+    }
+    if (p[1] == '{') {
+        const char *end = strchr(p + 2, '}');
+        if (end != NULL && var_name_ok(p + 2, end - p - 2)) {
+            var *v = var_find(p + 2, end - p - 2);
+            *next = end + 1;
+            return v ? v->entry + v->name_len + 1 : "";
+        }
+    } else if (p[1] == '?' || p[1] == '$') {
+        snprintf(num, 32, "%d", p[1] == '?' ? last_status : (int)getpid());
+        *next = p + 2;
+        return num;
+    } else {
+        const char *end = p + 1;
+        while (var_name_ok(p + 1, end - p)) {
+            end++;
+        }
+        if (end > p + 1) {
+            var *v = var_find(p + 1, end - p - 1);
+            *next = end;
+            return v ? v->entry + v->name_len + 1 : "";
+        }
+    }
+
+    return NULL;
+}
+
+// Expand $NAME, ${NAME}, $? and $$ in a word. Returns a new string, or NULL on error
+char *expand_vars(const char *word) {
+    size_t cap = strlen(word) + 1, len = 0;
+    char *out = malloc(cap);
+
+    for (const char *p = word; out != NULL && *p;) {
+        char num[32];
+        const char *next = p + 1;
+        const char *val = var_value(p, &next, num);
+
+        size_t vlen = val ? strlen(val) : 1;
+        if (len + vlen + strlen(next) + 1 > cap) {
+            cap = len + vlen + strlen(next) + 1;
+            char *o = realloc(out, cap);
+            if (o == NULL) {
+                free(out);
+                return NULL;
+            }
+            out = o;
+        }
+        memcpy(out + len, val ? val : p, vlen);
+        len += vlen;
+        p = next;
+    }
+    if (out != NULL) {
+        out[len] = '\0';
+    }
+
+    return out;
+}
+
+// Exec args[0] with envp, searching the shell's PATH. Only returns on error
+void execSearch(char **args, char **envp) {
+    const char *path = var_get("PATH");
+    char full[4096];
+    int err = ENOENT;
+
+    if (strchr(args[0], '/') != NULL) {
+        execve(args[0], args, envp);
+        return;
+    }
+    if (path == NULL) {
+        path = "/usr/bin:/bin";
+    }
+    while (1) {
+        const char *colon = strchr(path, ':');
+        size_t dlen = colon ? (size_t)(colon - path) : strlen(path);
+        if (dlen == 0) { // Empty entry means the current directory
+            snprintf(full, sizeof(full), "%s", args[0]);
+        } else {
+            snprintf(full, sizeof(full), "%.*s/%s", (int)dlen, path, args[0]);
+        }
+        execve(full, args, envp);
+        if (errno == ENOEXEC) { // No #! line, so run it as a shell script
+            int n = 0;
+            while (args[n] != NULL) {
+                n++;
+            }
+            char *sh[n + 2];
+            sh[0] = "/bin/sh";
+            sh[1] = full;
+            memcpy(sh + 2, args + 1, n * sizeof(char *));
+            execve(sh[0], sh, envp);
+        }
+        if (errno != ENOENT && errno != ENOTDIR) {
+            err = errno;
+        }
+        if (colon == NULL) {
+            break;
+        }
+        path = colon + 1;
+    }
+    errno = err;
+}
+
+// export built-in: export [NAME[=value]...]
+int export_builtin(char **args, int num_args) {
+    if (num_args == 1) {
+        vars_init();
+        for (char **e = var_envp(); *e != NULL; e++) {
+            printf("export %s\n", *e);
+        }
+        return 0;
+    }
+    for (int i = 1; i < num_args; i++) {
+        char *eq = strchr(args[i], '=');
+        size_t len = eq ? (size_t)(eq - args[i]) : strlen(args[i]);
+        if (var_set(args[i], len, eq ? eq + 1 : NULL, 1) == -1) {
+            printf("export: invalid name %s\n", args[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// unset built-in: unset NAME...
+int unset_builtin(char **args, int num_args) {
+    for (int i = 1; i < num_args; i++) {
+        var_unset(args[i]);
+    }
+    return 0;
+}
+
+// Directory listings read while expanding globs, kept until the end of the input line
+static glob_dir *glob_cache[GLOB_CACHE_BUCKETS];
+
+// (Re)read a cached listing. Timestamps can be as coarse as a second, so a
+// directory changed within a second of being read may keep the same mtime;
+// such a listing is never reused
+static void glob_read(glob_dir *g, const char *path, const struct stat *st) {
+    struct timespec now;
+    char *key = g->dl.path;
+
+    g->dl.path = NULL;
+    free_dir(&g->dl);
+    g->ok = read_dir(path, &g->dl) == 0;
+    g->dl.path = key;
+    g->dev = st->st_dev;
+    g->ino = st->st_ino;
+    clock_gettime(CLOCK_REALTIME, &now);
+    g->settled = g->ok && now.tv_sec - g->dl.mtime.tv_sec >= 2;
+}
+
+// Listing of a directory ("" is the current one). Reused while it is the same
+// directory with the same mtime, which a cd or a new file changes. NULL if unreadable
+static const dir_listing *glob_listing(const char *path) {
+    struct stat st;
+
+    if (*path == '\0') {
+        path = ".";
+    }
+    if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode)) {
+        return NULL;
+    }
+    unsigned h = var_hash(path, strlen(path)) & (GLOB_CACHE_BUCKETS - 1);
+    for (glob_dir *g = glob_cache[h]; g != NULL; g = g->next) {
+        if (strcmp(g->dl.path, path) == 0) {
+            if (!g->settled || g->dev != st.st_dev || g->ino != st.st_ino
+                || g->dl.mtime.tv_sec != st.st_mtim.tv_sec || g->dl.mtime.tv_nsec != st.st_mtim.tv_nsec) {
+                glob_read(g, path, &st);
+            }
+            return g->ok ? &g->dl : NULL;
+        }
+    }
+
+    glob_dir *g = calloc(1, sizeof(glob_dir));
+    if (g == NULL) {
+        return NULL;
+    }
+    g->dl.path = strdup(path);
+    if (g->dl.path == NULL) {
+        free(g);
+        return NULL;
+    }
+    glob_read(g, path, &st);
+    g->next = glob_cache[h];
+    glob_cache[h] = g;
+
+    return g->ok ? &g->dl : NULL;
+}
+
+// Forget the listings read for the last input line
+void glob_cache_clear() {
+    for (int i = 0; i < GLOB_CACHE_BUCKETS; i++) {
+        for (glob_dir *g = glob_cache[i], *next; g != NULL; g = next) {
+            next = g->next;
+            free_dir(&g->dl);
+            free(g);
+        }
+        glob_cache[i] = NULL;
+    }
+}
+
+// Whether a word has any unescaped glob characters
+int has_glob(const char *word) {
+    for (const char *p = word; *p; p++) {
+        if (*p == '\\' && p[1] != '\0') {
+            p++;
+        } else if (*p == '*' || *p == '?' || (*p == '[' && strchr(p + 1, ']') != NULL)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Compile one path component (pattern[0..len)) into ops. Returns -1 on error
+static int glob_compile(const char *pattern, size_t len, glob_pat *g) {
+    g->ops = malloc((len + 1) * sizeof(glob_op));
+    g->num = 0;
+    if (g->ops == NULL) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        glob_op *op = &g->ops[g->num];
+        memset(op, 0, sizeof(*op));
+        char c = pattern[i];
+
+        if (c == '*') {
+            if (g->num > 0 && g->ops[g->num - 1].type == GLOB_STAR) {
+                continue; // ** inside a component is the same as *
+            }
+            op->type = GLOB_STAR;
+        } else if (c == '?') {
+            op->type = GLOB_ANY;
+        } else if (c == '[' && memchr(pattern + i + 1, ']', len - i - 1) != NULL) {
+            size_t j = i + 1;
+            int negate = j < len && (pattern[j] == '!' || pattern[j] == '^');
+            j += negate;
+            op->type = GLOB_CLASS;
+            // A ] right after the opening bracket is part of the set
+            for (int first = 1; j < len && (first || pattern[j] != ']'); j++, first = 0) {
+                unsigned char lo = pattern[j], hi = lo;
+                if (j + 2 < len && pattern[j + 1] == '-' && pattern[j + 2] != ']') {
+                    hi = pattern[j + 2];
+                    j += 2;
+                }
+                for (unsigned ch = lo; ch <= hi; ch++) {
+                    op->set[ch / 32] |= 1u << (ch % 32);
+                }
+            }
+            if (j >= len) { // No closing bracket after all, so it's a literal [
+                op->type = GLOB_LIT;
+                op->c = '[';
+                memset(op->set, 0, sizeof(op->set));
+            } else {
+                if (negate) {
+                    for (int k = 0; k < 8; k++) {
+                        op->set[k] = ~op->set[k];
+                    }
+                }
+                i = j;
+            }
+        } else {
+            if (c == '\\' && i + 1 < len) {
+                c = pattern[++i];
+            }
+            op->type = GLOB_LIT;
+            op->c = c;
+        }
+        g->num++;
+    }
+
+    // Literal prefix and suffix let most names be rejected with a memcmp
+    g->prefix_len = 0;
+    while (g->prefix_len < g->num && g->prefix_len < sizeof(g->prefix) && g->ops[g->prefix_len].type == GLOB_LIT) {
+        g->prefix[g->prefix_len] = g->ops[g->prefix_len].c;
+        g->prefix_len++;
+    }
+    size_t s = g->num;
+    while (s > g->prefix_len && g->ops[s - 1].type == GLOB_LIT && g->num - s < sizeof(g->suffix)) {
+        s--;
+    }
+    g->suffix_len = g->num - s;
+    for (size_t k = 0; k < g->suffix_len; k++) {
+        g->suffix[k] = g->ops[s + k].c;
+    }
+
+    return 0;
+}
+
+static int glob_op_match(const glob_op *op, unsigned char c) {
+    switch (op->type) {
+        case GLOB_LIT: return op->c == (char)c;
+        case GLOB_ANY: return 1;
+        case GLOB_CLASS: return (op->set[c / 32] >> (c % 32)) & 1;
+    }
+    return 0;
+}
+
+// Match a name against a compiled component
+int glob_match(const glob_pat *g, const char *name, size_t len) {
+    if (len < g->prefix_len + g->suffix_len || memcmp(name, g->prefix, g->prefix_len) != 0
+            || memcmp(name + len - g->suffix_len, g->suffix, g->suffix_len) != 0) {
+        return 0;
+    }
+
+    // Greedy scan that backtracks to the most recent star on a mismatch
+    size_t i = 0, star = (size_t)-1;
+    const char *s = name, *end = name + len, *star_s = NULL;
+    while (s < end) {
+        if (i < g->num && g->ops[i].type == GLOB_STAR) {
+            star = ++i;
+            star_s = s;
+        } else if (i < g->num && glob_op_match(&g->ops[i], *s)) {
+            i++;
+            s++;
+        } else if (star != (size_t)-1) {
+            i = star;
+            s = ++star_s;
+        } else {
+            return 0;
+        }
+    }
+    while (i < g->num && g->ops[i].type == GLOB_STAR) {
+        i++;
+    }
+
+    return i == g->num;
+}
+
+// Whether path is a directory, using d_type when the filesystem gives it
+static int glob_isdir(const char *path, unsigned char type) {
+    struct stat st;
+
+    if (type == DT_DIR) {
+        return 1;
+    }
+    if (type != DT_LNK && type != DT_UNKNOWN) {
+        return 0;
+    }
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+// Add every non-hidden path below base, for a trailing **
+static void glob_all(char *base, size_t blen, int dirs_only, matches *out) {
+    const dir_listing *dl = glob_listing(base);
+    if (dl == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < dl->num; i++) {
+        const char *name = dl->names + dl->offs[i];
+        size_t nlen = strlen(name);
+        if (name[0] == '.' || blen + nlen + 2 >= GLOB_PATH_MAX) {
+            continue;
+        }
+        memcpy(base + blen, name, nlen + 1);
+        int isdir = dl->types[i] != DT_LNK && glob_isdir(base, dl->types[i]);
+        if (isdir && dirs_only) {
+            strcpy(base + blen + nlen, "/");
+        }
+        if (isdir || !dirs_only) {
+            add_match(out, base, 0);
+        }
+        if (isdir) {
+            strcpy(base + blen + nlen, "/");
+            glob_all(base, blen + nlen + 1, dirs_only, out);
+        }
+    }
+    base[blen] = '\0';
+}
+
+// Match the remaining components under base (empty or ending in '/'), adding hits to out
+static void glob_walk(char *base, size_t blen, char **comps, int ncomp, int dirs_only, matches *out) {
+    if (ncomp == 0) {
+        add_match(out, base, 0);
+        return;
+    }
+    if (blen + 1 >= GLOB_PATH_MAX) {
+        return;
+    }
+
+    const char *comp = comps[0];
+    int last = ncomp == 1;
+
+    if (!has_glob(comp)) { // Plain component, no need to list anything
+        size_t clen = strlen(comp);
+        if (blen + clen + 2 >= GLOB_PATH_MAX) {
+            return;
+        }
+        memcpy(base + blen, comp, clen + 1);
+        // Strip the escapes so \* can name a literal *
+        char *w = base + blen;
+        for (char *r = w; *r; r++) {
+            if (*r == '\\' && r[1] != '\0') {
+                r++;
+            }
+            *w++ = *r;
+        }
+        *w = '\0';
+        size_t nlen = w - base;
+        struct stat st;
+        if (last) {
+            if (lstat(base, &st) == 0 && (!dirs_only || S_ISDIR(st.st_mode))) {
+                if (dirs_only) {
+                    strcpy(base + nlen, "/");
+                }
+                add_match(out, base, 0);
+            }
+        } else {
+            strcpy(base + nlen, "/");
+            glob_walk(base, nlen + 1, comps + 1, ncomp - 1, dirs_only, out);
+        }
+        base[blen] = '\0';
+        return;
+    }
+
+    const dir_listing *dl = glob_listing(base);
+    if (dl == NULL) {
+        return;
+    }
+
+    if (strcmp(comp, "**") == 0) {
+        if (last) { // Trailing ** matches the directory itself and everything below it
+            if (blen > 0) {
+                add_match(out, base, 0);
+            }
+            glob_all(base, blen, dirs_only, out);
+            return;
+        }
+        // Zero directories, then each subdirectory with ** still in front
+        glob_walk(base, blen, comps + 1, ncomp - 1, dirs_only, out);
+        for (size_t i = 0; i < dl->num; i++) {
+            const char *name = dl->names + dl->offs[i];
+            if (name[0] == '.') {
+                continue;
+            }
+            size_t nlen = strlen(name);
+            if (blen + nlen + 2 >= GLOB_PATH_MAX) {
+                continue;
+            }
+            memcpy(base + blen, name, nlen + 1);
+            // Don't follow symlinks, so loops can't recurse forever
+            if (dl->types[i] != DT_LNK && glob_isdir(base, dl->types[i])) {
+                strcpy(base + blen + nlen, "/");
+                glob_walk(base, blen + nlen + 1, comps, ncomp, dirs_only, out);
+            }
+        }
+        base[blen] = '\0';
+        return;
+    }
+
+    glob_pat g;
+    if (glob_compile(comp, strlen(comp), &g) == -1) {
+        return;
+    }
+    for (size_t i = 0; i < dl->num; i++) {
+        const char *name = dl->names + dl->offs[i];
+        size_t nlen = strlen(name);
+        // Hidden names only match a pattern that starts with a literal dot
+        if ((name[0] == '.' && comp[0] != '.') || !glob_match(&g, name, nlen) || blen + nlen + 2 >= GLOB_PATH_MAX) {
+            continue;
+        }
+        memcpy(base + blen, name, nlen + 1);
+        if (last) {
+            if (!dirs_only) {
+                add_match(out, base, 0);
+            } else if (glob_isdir(base, dl->types[i])) {
+                strcpy(base + blen + nlen, "/");
+                add_match(out, base, 0);
+            }
+        } else if (glob_isdir(base, dl->types[i])) {
+            strcpy(base + blen + nlen, "/");
+            glob_walk(base, blen + nlen + 1, comps + 1, ncomp - 1, dirs_only, out);
+        }
+    }
+    base[blen] = '\0';
+    free(g.ops);
+}
+
+// Expand a glob pattern into sorted matches. Leaves out empty when nothing matches
+void glob_expand(const char *pattern, matches *out) {
+    char *copy = strdup(pattern);
+    char base[GLOB_PATH_MAX];
+    char *comps[GLOB_PATH_MAX / 2];
+    int ncomp = 0;
+
+    if (copy == NULL) {
+        return;
+    }
+    size_t plen = strlen(copy);
+    int dirs_only = plen > 1 && copy[plen - 1] == '/';
+    base[0] = '\0';
+    if (copy[0] == '/') {
+        strcpy(base, "/");
+    }
+    for (char *save = NULL, *c = strtok_r(copy, "/", &save); c != NULL; c = strtok_r(NULL, "/", &save)) {
+        comps[ncomp++] = c;
+    }
+
+    glob_walk(base, strlen(base), comps, ncomp, dirs_only, out);
+    qsort(out->v, out->num, sizeof(char *), match_cmp);
+    free(copy);
+}
+
+// Put body in an fd a child can read as stdin. Bodies that fit in a pipe
+// buffer go through a pipe; bigger ones go in a sealed memfd. Nothing touches
+// the filesystem. Returns -1 on error
+int body_fd(const char *body, size_t len) {
+    int fds[2];
+
+    if (len <= HEREDOC_PIPE_MAX && pipe2(fds, O_CLOEXEC) == 0) {
+        // A user over pipe-user-pages-soft gets pipes of only a page or two, so check
+        // the real size: the write must not block with nobody reading yet
+        int size = fcntl(fds[1], F_GETPIPE_SZ);
+        if (size >= 0 && len <= (size_t)size && write(fds[1], body, len) == (ssize_t)len) {
+            close(fds[1]);
+            return fds[0];
+        }
+        close(fds[0]);
+        close(fds[1]);
+    }
+
+    int fd = memfd_create("wsh-heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1) {
+        perror("memfd_create");
+        return -1;
+    }
+    for (size_t off = 0; off < len;) {
+        ssize_t n = write(fd, body + off, len - off);
+        if (n <= 0) {
+            perror("heredoc");
+            close(fd);
+            return -1;
+        }
+        off += n;
+    }
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+    lseek(fd, 0, SEEK_SET);
+
+    return fd;
+}
+
+// Forget the bodies read for the last line
+void heredocs_clear() {
+    for (int i = 0; i < num_heredocs; i++) {
+        free(heredocs[i]);
+    }
+    num_heredocs = next_heredoc = 0;
+}
+
+// Read the bodies of any << heredocs in line from the input, up to each delimiter
+// line, after the ones already read for the earlier lines of a loop. Variables are
+// left for take_redirects, so a loop body sees new values on every pass
+void collect_heredocs(const char *line) {
+    char *copy = strdup(line);
+    char *buf = NULL;
+    size_t bufsize = 0;
+
+    if (copy == NULL) {
+        return;
+    }
+
+    char *save = NULL;
+    for (char *tok = strtok_r(copy, " \t\n;", &save); tok != NULL; tok = strtok_r(NULL, " \t\n;", &save)) {
+        if (strncmp(tok, "<<", 2) != 0 || tok[2] == '<') {
+            continue;
+        }
+        const char *delim = tok[2] ? tok + 2 : strtok_r(NULL, " \t\n;", &save);
+        if (delim == NULL || num_heredocs == MAX_HEREDOCS) {
+            break;
+        }
+
+        char *body = NULL;
+        size_t len = 0, cap = 0;
+        while (1) {
+            if (isatty(STDIN_FILENO)) {
+                printf("> ");
+            }
+            if (read_line(&buf, &bufsize) == -1) {
+                break;
+            }
+            size_t n = strcspn(buf, "\n");
+            if (n == strlen(delim) && strncmp(buf, delim, n) == 0) {
+                break;
+            }
+            size_t blen = strlen(buf);
+            if (len + blen + 1 > cap) {
+                cap = (len + blen + 1) * 2;
+                char *b = realloc(body, cap);
+                if (b == NULL) {
+                    break;
+                }
+                body = b;
+            }
+            memcpy(body + len, buf, blen);
+            len += blen;
+            body[len] = '\0';
+        }
+        heredocs[num_heredocs++] = body ? body : strdup("");
+    }
+    free(buf);
+    free(copy);
+}
+
+// Strip << and <<< redirections from args, returning the fd to use as stdin
+// (or -1 if there are none). *num_args is updated
+static int take_redirects(char **args, int *num_args) {
+    int fd = -1;
+    int j = 0;
+
+    for (int i = 0; i < *num_args; i++) {
+        if (strncmp(args[i], "<<", 2) != 0) {
+            args[j++] = args[i];
+            continue;
+        }
+        int is_string = args[i][2] == '<';
+        const char *operand = args[i] + (is_string ? 3 : 2);
+        if (*operand == '\0') {
+            if (i + 1 >= *num_args) {
+                printf("wsh: missing operand for %s\n", args[i]);
+                break;
+            }
+            operand = args[++i];
+        }
+        if (fd != -1) { // Last redirection wins
+            close(fd);
+        }
+        if (is_string) { // Here-string: the word plus a newline
+            size_t len = strlen(operand);
+            char *body = malloc(len + 2);
+            if (body == NULL) {
+                continue;
+            }
+            memcpy(body, operand, len);
+            strcpy(body + len, "\n");
+            fd = body_fd(body, len + 1);
+            free(body);
+        } else {
+            const char *body = "";
+            if (cmd_heredocs != NULL) {
+                body = next_cmd_heredoc < num_cmd_heredocs ? cmd_heredocs[next_cmd_heredoc++] : "";
+            } else if (next_heredoc < num_heredocs) {
+                body = heredocs[next_heredoc++];
+            }
+            // Variables in the body are expanded, as in an unquoted sh heredoc
+            char *exp = strchr(body, '$') != NULL ? expand_vars(body) : NULL;
+            fd = exp != NULL ? body_fd(exp, strlen(exp)) : body_fd(body, strlen(body));
+            free(exp);
+        }
+    }
+    args[j] = NULL;
+    *num_args = j;
+
+    return fd;
+}
+
+// Parse the input line into separate commands
+void parseCmds(char *line, char ***commands, int *num_commands) {
+    char *start = line;
+    int depth = 0; // ; inside $(...) belongs to the substitution
+    *num_commands = 0;
+
+    for (char *p = line; ; p++) {
+        if (*p == '$' && p[1] == '(') {
+            depth++;
+            p++;
+        } else if (*p == ')' && depth > 0) {
+            depth--;
+        } else if ((*p == ';' && depth == 0) || *p == '\0') {
+            int end = *p == '\0';
+            *p = '\0';
+            if (p > start) { // Skip empty cmds, as strtok did
+                (*commands)[*num_commands] = start; // Add cmd to list of cmds
+                (*num_commands)++; // Increment number of cmds
+            }
+            if (end) {
+                break;
+            }
+            start = p + 1;
+        }
+    }
+}
+ 
+// Add a finished word to args, expanding globs. Words that expanded to nothing are dropped, as in sh
+static int add_word(char ***args, int *num_args, size_t *cap, char *word, size_t len) {
+    matches m = { NULL, NULL, 0, 0 };
+
+    if (len == 0) {
+        return 0;
+    }
+    word[len] = '\0';
+    if (has_glob(word)) {
+        glob_expand(word, &m);
+    }
+
+    size_t n = m.num > 0 ? m.num : 1;
+    if (*num_args + n + 1 > *cap) {
+        *cap = (*num_args + n + 1) * 2;
+        char **grown = realloc(*args, sizeof(char **) * *cap);
+        if (grown == NULL) {
+            free_matches(&m);
+            return -1;
+        }
+        *args = grown;
+    }
+    if (m.num > 0) { // Replace the pattern with its matches
+        memcpy(*args + *num_args, m.v, m.num * sizeof(char *));
+        *num_args += m.num;
+        m.num = 0;
+    } else {
+        char *copy = strdup(word);
+        if (copy == NULL) {
+            return -1;
+        }
+        (*args)[(*num_args)++] = copy; // Add arg to list of args
+    }
+    free_matches(&m);
+
+    return 0;
+}
+
+// Append n bytes to a growable word buffer
+static int word_append(char **w, size_t *len, size_t *cap, const char *src, size_t n) {
+    if (*len + n + 1 > *cap) {
+        size_t c = *cap ? *cap * 2 : 64;
+        while (*len + n + 1 > c) {
+            c *= 2;
+        }
+        char *g = realloc(*w, c);
+        if (g == NULL) {
+            return -1;
+        }
+        *w = g;
+        *cap = c;
+    }
+    memcpy(*w + *len, src, n);
+    *len += n;
+
+    return 0;
+}
+
+// Find the ) matching the ( at p. Returns NULL if it isn't closed
+static char *match_paren(char *p) {
+    int depth = 0;
+    for (; *p; p++) {
+        if (*p == '(') {
+            depth++;
+        } else if (*p == ')' && --depth == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// Split line into arguments, expanding variables, $(...) and globs
+int sepArgs(char *line, char ***args, int *num_args) {
+    size_t cap = 16;
+    char *w = NULL; // Word being built
+    size_t wlen = 0, wcap = 0;
+    int in_word = 0;
+    int ret = 0;
+
+    *num_args = 0;
+    *args = malloc(sizeof(char **) * cap);
+    if (*args == NULL) {
+        return -1;
+    }
+
+    for (char *p = line; ret == 0; ) {
+        if (*p == '\0' || *p == ' ' || *p == '\t' || *p == '\n') {
+            if (in_word) {
+                ret = add_word(args, num_args, &cap, w, wlen);
+                wlen = 0;
+                in_word = 0;
+            }
+            if (*p == '\0') {
+                break;
+            }
+            p++;
+            continue;
+        }
+        in_word = 1;
+
+        if (p[0] == '$' && p[1] == '(') { // Command substitution
+            char *close = match_paren(p + 1);
+            if (close == NULL) {
+                printf("wsh: missing )\n");
+                ret = -1;
+                break;
+            }
+            *close = '\0';
+            capture out = { NULL, 0, 0 };
+            command_subst(p + 2, &out);
+            // Split the output on whitespace; the first field joins the current word
+            for (size_t i = 0; i < out.len && ret == 0; i++) {
+                char c = out.buf[i];
+                if (c == ' ' || c == '\t' || c == '\n') {
+                    if (in_word) {
+                        ret = add_word(args, num_args, &cap, w, wlen);
+                        wlen = 0;
+                        in_word = 0;
+                    }
+                } else {
+                    ret = word_append(&w, &wlen, &wcap, &c, 1);
+                    in_word = 1;
+                }
+            }
+            free(out.buf);
+            p = close + 1;
+            continue;
+        }
+
+        char num[32];
+        const char *next;
+        const char *val = var_value(p, &next, num);
+        if (val != NULL) {
+            ret = word_append(&w, &wlen, &wcap, val, strlen(val));
+            p = (char *)next;
+        } else {
+            ret = word_append(&w, &wlen, &wcap, p, 1);
+            p++;
+        }
+    }
+    free(w);
+    (*args)[*num_args] = NULL;
+
+    return ret;
+}
+
+// Coprocesses: long-lived children the shell talks to over a pair of pipes
+static coproc coprocs[MAX_COPROCS];
+static int num_coprocs = 0;
+
+static coproc *coproc_find(const char *name) {
+    for (int i = 0; i < num_coprocs; i++) {
+        if (strcmp(coprocs[i].name, name) == 0) {
+            return &coprocs[i];
+        }
+    }
+    return NULL;
+}
+
+// Close a coproc's pipes and forget it. The job table reaps the process
+static void coproc_close(int i) {
+    close(coprocs[i].in);
+    close(coprocs[i].out);
+    free(coprocs[i].name);
+    free(coprocs[i].buf);
+    coprocs[i] = coprocs[--num_coprocs];
+}
+
+// Forget coprocs whose process has gone, and shut down ones idle for too long
+void coproc_reap() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (int i = num_coprocs - 1; i >= 0; i--) {
+        coproc *c = &coprocs[i];
+        int alive = 0;
+        for (int j = 0; j < num_jobs; j++) {
+            if (jobs[j].pid == c->pid && (jobs[j].state == JOB_RUNNING || jobs[j].state == JOB_STOPPED)) {
+                alive = 1;
+                break;
+            }
+        }
+        double idle = (now.tv_sec - c->last_used.tv_sec) + (now.tv_nsec - c->last_used.tv_nsec) / 1e9;
+        if (!alive) {
+            coproc_close(i);
+        } else if (c->idle > 0 && idle >= c->idle) {
+            pid_t pid = c->pid;
+            coproc_close(i); // EOF on its stdin is usually enough
+            kill(pid, SIGTERM);
+            kill(pid, SIGCONT);
+        }
+    }
+}
+
+// coproc [-i IDLE] NAME COMMAND [ARGS...]: start COMMAND with its stdin and
+// stdout connected to the shell. It is shut down after IDLE unused (5m by default, 0 for never)
+int coproc_builtin(char **args, int num_args) {
+    double idle = COPROC_IDLE;
+    int i = 1;
+
+    if (i < num_args && strcmp(args[i], "-i") == 0) {
+        if (i + 1 >= num_args || (idle = parse_duration(args[i + 1])) < 0) {
+            printf("coproc: invalid idle time\n");
+            return -1;
+        }
+        i += 2;
+    }
+    if (num_args - i < 2) {
+        printf("Usage: coproc [-i IDLE] NAME COMMAND [ARGS...]\n");
+        return -1;
+    }
+    char *name = args[i];
+    if (!var_name_ok(name, strlen(name))) {
+        printf("coproc: invalid name: %s\n", name);
+        return -1;
+    }
+    coproc_reap(); // A finished coproc's name can be reused
+    if (coproc_find(name) != NULL) {
+        printf("coproc: %s already running\n", name);
+        return -1;
+    }
+    if (num_coprocs == MAX_COPROCS) {
+        printf("coproc: too many coprocs\n");
+        return -1;
+    }
+
+    // The shell's ends are close-on-exec so other children don't hold them open
+    int to[2], from[2];
+    if (pipe2(to, O_CLOEXEC) == -1) {
+        perror("pipe");
+        return -1;
+    }
+    if (pipe2(from, O_CLOEXEC) == -1) {
+        perror("pipe");
+        close(to[0]);
+        close(to[1]);
+        return -1;
+    }
+
+    limits lim;
+    for (int l = 0; l < NUM_LIMITS; l++) {
+        lim.value[l] = default_limits.value[l] < cmd_limits.value[l] ? default_limits.value[l] : cmd_limits.value[l];
+    }
+
+    struct timespec spawn_start;
+    clock_gettime(CLOCK_MONOTONIC, &spawn_start);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(to[0]);
+        close(to[1]);
+        close(from[0]);
+        close(from[1]);
+        return -1;
+    } else if (pid == 0) { // Child
+        if (headless || getpid() != getsid(0)) {
+            setpgid(0, 0);
+        }
+        apply_limits(&lim);
+        apply_prio(current_prio());
+        dup2(to[0], STDIN_FILENO);
+        dup2(from[1], STDOUT_FILENO);
+        for (int a = 0; a < num_cmd_assigns; a++) {
+            char *eq = strchr(cmd_assigns[a], '=');
+            var_set(cmd_assigns[a], eq - cmd_assigns[a], eq + 1, 1);
+        }
+        execSearch(args + i + 1, var_envp());
+        perror("execvp");
+        _exit(127);
+    }
+    metrics_spawn(&spawn_start);
+    setpgid(pid, pid);
+    close(to[0]);
+    close(from[1]);
+
+    char job_name[256];
+    snprintf(job_name, sizeof(job_name), "coproc %s", name);
+    add_job(pid, job_name, 1);
+    jobs[num_jobs - 1].lim = lim;
+
+    coproc *c = &coprocs[num_coprocs++];
+    memset(c, 0, sizeof(*c));
+    c->name = strdup(name);
+    c->pid = pid;
+    c->in = to[1];
+    c->out = from[0];
+    c->idle = idle;
+    clock_gettime(CLOCK_MONOTONIC, &c->last_used);
+
+    // NAME_PID, as in bash
+    char pid_var[256], pid_str[32];
+    int len = snprintf(pid_var, sizeof(pid_var), "%s_PID", name);
+    snprintf(pid_str, sizeof(pid_str), "%d", (int)pid);
+    var_set(pid_var, len, pid_str, 0);
+
+    return 0;
+}
+
+// send NAME [WORDS...]: write the words as one line to the coproc's stdin
+int send_builtin(char **args, int num_args) {
+    if (num_args < 2) {
+        printf("Usage: send NAME [WORDS...]\n");
+        return -1;
+    }
+    coproc *c = coproc_find(args[1]);
+    if (c == NULL) {
+        printf("send: no such coproc: %s\n", args[1]);
+        return -1;
+    }
+
+    size_t len = 0;
+    for (int i = 2; i < num_args; i++) {
+        len += strlen(args[i]) + 1;
+    }
+    char *line = malloc(len + 1);
+    if (line == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    len = 0;
+    for (int i = 2; i < num_args; i++) {
+        size_t n = strlen(args[i]);
+        memcpy(line + len, args[i], n);
+        len += n;
+        line[len++] = i + 1 < num_args ? ' ' : '\n';
+    }
+    if (num_args == 2) {
+        line[len++] = '\n';
+    }
+
+    // A coproc that exited would raise SIGPIPE; block it and take EPIPE instead
+    sigset_t pipe_set, old;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, &old);
+    int ret = 0;
+    for (size_t off = 0; off < len; ) {
+        ssize_t n = write(c->in, line + off, len - off);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            if (errno == EPIPE) {
+                struct timespec zero = { 0, 0 };
+                sigtimedwait(&pipe_set, NULL, &zero); // Discard the pending SIGPIPE
+            }
+            perror("send");
+            ret = -1;
+            break;
+        }
+        off += n;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    free(line);
+    clock_gettime(CLOCK_MONOTONIC, &c->last_used);
+
+    return ret;
+}
+
+// recv NAME [VAR]: read one line from the coproc's stdout and print it, or
+// store it in VAR. Returns 1 once the coproc has closed its output
+int recv_builtin(char **args, int num_args) {
+    if (num_args < 2 || num_args > 3) {
+        printf("Usage: recv NAME [VAR]\n");
+        return -1;
+    }
+    coproc *c = coproc_find(args[1]);
+    if (c == NULL) {
+        printf("recv: no such coproc: %s\n", args[1]);
+        return -1;
+    }
+    if (num_args == 3 && !var_name_ok(args[2], strlen(args[2]))) {
+        printf("recv: invalid variable name: %s\n", args[2]);
+        return -1;
+    }
+
+    // Output is read in blocks; whatever follows the line stays buffered for the next recv
+    char *nl;
+    size_t line_len, used;
+    while ((nl = memchr(c->buf, '\n', c->len)) == NULL) {
+        if (c->cap - c->len < 4096) {
+            size_t cap = c->cap ? c->cap * 2 : 8192;
+            char *b = realloc(c->buf, cap);
+            if (b == NULL) {
+                perror("realloc");
+                return -1;
+            }
+            c->buf = b;
+            c->cap = cap;
+        }
+        ssize_t n = read(c->out, c->buf + c->len, c->cap - c->len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        c->len += n;
+    }
+    if (nl != NULL) {
+        line_len = nl - c->buf;
+        used = line_len + 1;
+    } else if (c->len > 0) { // Last line without a newline
+        line_len = used = c->len;
+    } else {
+        return 1;
+    }
+
+    if (num_args == 3) {
+        char *value = strndup(c->buf, line_len);
+        if (value != NULL) {
+            var_set(args[2], strlen(args[2]), value, 0);
+            free(value);
+        }
+    } else {
+        printf("%.*s\n", (int)line_len, c->buf);
+    }
+    memmove(c->buf, c->buf + used, c->len - used);
+    c->len -= used;
+    clock_gettime(CLOCK_MONOTONIC, &c->last_used);
+
+    return 0;
+}
+
+// Native cat, head and wc. They run in the shell (or the pipeline child it
+// forked) instead of exec'ing the real tools, and fall back to them for
+// anything they don't support
+
+// Options of a native file tool, and whether it can run at all
+static int native_parse(char **args, int num_args, native_opts *o) {
+    memset(o, 0, sizeof(*o));
+    o->count = 10;
+    if (num_args > 1 && strcmp(args[num_args - 1], "&") == 0) {
+        return -1; // Background jobs need a process
+    }
+    if (cmd_timeout.duration > 0 || current_prio() != PRIO_INTERACTIVE) {
+        return -1;
+    }
+    for (int i = 0; i < NUM_LIMITS; i++) {
+        if (cmd_limits.value[i] != RLIM_INFINITY) {
+            return -1;
+        }
+    }
+
+    int i = 1;
+    for (; i < num_args && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        char *a = args[i];
+        if (strcmp(a, "--") == 0) {
+            i++;
+            break;
+        }
+        if (strcmp(args[0], "head") == 0) {
+            char *num;
+            if (a[1] == 'n' || a[1] == 'c') {
+                o->by_bytes = a[1] == 'c';
+                num = a[2] != '\0' ? a + 2 : (i + 1 < num_args ? args[++i] : NULL);
+            } else {
+                num = a + 1; // -N
+            }
+            char *end;
+            if (num == NULL || *num < '0' || *num > '9') {
+                return -1; // Includes the all-but-last -n -N form
+            }
+            o->count = strtoll(num, &end, 10);
+            if (*end != '\0') {
+                return -1; // Size suffixes
+            }
+        } else if (strcmp(args[0], "wc") == 0) {
+            for (char *f = a + 1; *f != '\0'; f++) {
+                if (*f == 'l') {
+                    o->lines = 1;
+                } else if (*f == 'w') {
+                    o->words = 1;
+                } else if (*f == 'c') {
+                    o->bytes = 1;
+                } else {
+                    return -1;
+                }
+            }
+        } else {
+            return -1; // cat has no options here
+        }
+    }
+    if (strcmp(args[0], "wc") == 0 && !o->lines && !o->words && !o->bytes) {
+        o->lines = o->words = o->bytes = 1;
+    }
+    o->first_file = i;
+
+    // The shell's own stdin is the script or terminal; leave reading it to the real tool
+    int reads_stdin = i == num_args;
+    for (; i < num_args; i++) {
+        reads_stdin |= strcmp(args[i], "-") == 0;
+    }
+    if (reads_stdin && !in_pipeline && cmd_stdin == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Count newlines 16 bytes at a time with GCC vector extensions. 16 maps onto
+// SSE2/NEON registers everywhere; wider vectors get split up and run slower
+size_t count_newlines(const char *p, size_t len) {
+    typedef unsigned char nl_vec __attribute__((vector_size(16)));
+    size_t count = 0, i = 0;
+    nl_vec nl;
+
+    memset(&nl, '\n', sizeof(nl));
+    while (len - i >= sizeof(nl_vec)) {
+        // Byte lanes can count to 255 before they have to be summed
+        nl_vec acc = { 0 };
+        size_t blocks = (len - i) / sizeof(nl_vec);
+        if (blocks > 255) {
+            blocks = 255;
+        }
+        for (size_t b = 0; b < blocks; b++, i += sizeof(nl_vec)) {
+            nl_vec v;
+            memcpy(&v, p + i, sizeof(v));
+            acc -= (nl_vec)(v == nl); // Matching lanes are -1
+        }
+        for (size_t k = 0; k < sizeof(nl_vec); k++) {
+            count += acc[k];
+        }
+    }
+    for (; i < len; i++) {
+        count += p[i] == '\n';
+    }
+
+    return count;
+}
+
+// Offset just past the *n-th newline in p, or len if there are fewer. *n is
+// reduced by the newlines passed
+static size_t line_end(const char *p, size_t len, long long *n) {
+    size_t off = 0;
+
+    // Skip whole blocks with the vector count, then find the exact line
+    while (len - off > 65536) {
+        size_t c = count_newlines(p + off, 65536);
+        if ((long long)c >= *n) {
+            break;
+        }
+        *n -= c;
+        off += 65536;
+    }
+    while (*n > 0 && off < len) {
+        const char *nl = memchr(p + off, '\n', len - off);
+        if (nl == NULL) {
+            return len;
+        }
+        off = nl - p + 1;
+        (*n)--;
+    }
+
+    return *n > 0 ? len : off;
+}
+
+// Write to stdout, which is a memory stream while $(...) is captured in-process
+static int out_write(const char *buf, size_t len) {
+    if (fileno(stdout) == -1) {
+        return fwrite(buf, 1, len, stdout) == len ? 0 : -1;
+    }
+    while (len > 0) {
+        ssize_t n = write(STDOUT_FILENO, buf, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+// Copy up to limit bytes (all of it when negative) from fd to stdout. sendfile
+// covers regular files and splice pipes; anything else is read and written
+static int out_copy(int fd, long long limit) {
+    int mode = fileno(stdout) == -1 ? 2 : 0; // 0 sendfile, 1 splice, 2 read/write
+    long long left = limit < 0 ? LLONG_MAX : limit;
+    char buf[65536];
+
+    while (left > 0 && !native_intr) {
+        size_t chunk = left > (1 << 20) ? (1 << 20) : left;
+        ssize_t n;
+        if (mode == 0) {
+            n = sendfile(STDOUT_FILENO, fd, NULL, chunk);
+            if (n == -1 && (errno == EINVAL || errno == ENOSYS)) {
+                mode = 1;
+                continue;
+            }
+        } else if (mode == 1) {
+            n = splice(fd, NULL, STDOUT_FILENO, NULL, chunk, SPLICE_F_MOVE);
+            if (n == -1 && errno == EINVAL) {
+                mode = 2;
+                continue;
+            }
+        } else {
+            n = read(fd, buf, chunk < sizeof(buf) ? chunk : sizeof(buf));
+            if (n > 0 && out_write(buf, n) == -1) {
+                return -1;
+            }
+        }
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        left -= n;
+    }
+
+    return 0;
+}
+
+// First n lines of fd: found with pread, then sent with sendfile. Reading
+// rather than mapping means a file truncated under us can't SIGBUS the shell
+static int head_lines(int fd, long long n) {
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    long long end = 0;
+    char buf[65536];
+
+    while (n > 0 && !native_intr) {
+        ssize_t r = pread(fd, buf, sizeof(buf), pos + end);
+        if (r == -1 && errno == EINTR) {
+            continue;
+        }
+        if (r == -1) {
+            return -1;
+        }
+        if (r == 0) {
+            break;
+        }
+        end += line_end(buf, r, &n);
+    }
+
+    return out_copy(fd, end);
+}
+
+// Words are runs of bytes other than C locale white space
+static long long count_words(const char *p, size_t len, int *in_word) {
+    long long words = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        int space = p[i] == ' ' || (p[i] >= '\t' && p[i] <= '\r');
+        words += !space && !*in_word;
+        *in_word = !space;
+    }
+
+    return words;
+}
+
+static int wc_fd(int fd, const native_opts *o, wc_counts *c) {
+    struct stat st;
+    int in_word = 0;
+
+    memset(c, 0, sizeof(*c));
+    if (!o->lines && !o->words && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        off_t pos = lseek(fd, 0, SEEK_CUR);
+        c->bytes = st.st_size > pos ? st.st_size - pos : 0;
+        return 0;
+    }
+
+    char buf[65536];
+    while (!native_intr) {
+        ssize_t r = read(fd, buf, sizeof(buf));
+        if (r == -1 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return r;
+        }
+        c->lines += o->lines ? count_newlines(buf, r) : 0;
+        c->words += o->words ? count_words(buf, r, &in_word) : 0;
+        c->bytes += r;
+    }
+
+    return 0;
+}
+
+static void wc_print(const native_opts *o, const wc_counts *c, int width, const char *name) {
+    const char *sep = "";
+
+    if (o->lines) {
+        printf("%*lld", width, c->lines);
+        sep = " ";
+    }
+    if (o->words) {
+        printf("%s%*lld", sep, width, c->words);
+        sep = " ";
+    }
+    if (o->bytes) {
+        printf("%s%*lld", sep, width, c->bytes);
+    }
+    printf(name != NULL ? " %s\n" : "\n", name);
+}
+
+// Run cat, head or wc in-process. Returns NATIVE_FALLBACK if the real tool is needed.
+// Only regular files qualify: reading a FIFO, tty or device can block for good,
+// and only a child can be killed out of that
+int file_builtin(char **args, int num_args) {
+    native_opts o;
+
+    if (native_parse(args, num_args, &o) == -1) {
+        return NATIVE_FALLBACK;
+    }
+
+    int in = cmd_stdin != -1 ? cmd_stdin : STDIN_FILENO;
+    int num_files = num_args - o.first_file;
+    int fds[num_files > 0 ? num_files : 1];
+    int errs[num_files > 0 ? num_files : 1];
+    int ret = 0;
+
+    // Open everything first: wc sizes its columns from all of the inputs
+    fds[0] = num_files == 0 ? in : -1;
+    for (int i = 1; i < num_files; i++) {
+        fds[i] = -1;
+    }
+    for (int i = 0; i < num_files; i++) {
+        const char *name = args[o.first_file + i];
+        // O_NONBLOCK so opening a FIFO doesn't wait for a writer before we can tell
+        fds[i] = strcmp(name, "-") == 0 ? in : open(name, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+        errs[i] = errno;
+    }
+
+    // Stat everything, both to check the inputs are files and to size wc's columns
+    long long size = 0;
+    for (int i = 0; i < (num_files > 0 ? num_files : 1); i++) {
+        struct stat st;
+        if (fds[i] != -1 && (fstat(fds[i], &st) == -1 || !S_ISREG(st.st_mode))) {
+            for (int j = 0; j < (num_files > 0 ? num_files : 1); j++) {
+                if (fds[j] != -1 && fds[j] != in) {
+                    close(fds[j]);
+                }
+            }
+            return NATIVE_FALLBACK;
+        }
+        size += fds[i] != -1 ? st.st_size : 0;
+    }
+
+    // Only now that the real tool won't be run too
+    for (int i = 0; i < num_files; i++) {
+        const char *name = args[o.first_file + i];
+        if (fds[i] != -1) {
+            continue;
+        }
+        if (strcmp(args[0], "head") == 0) {
+            fprintf(stderr, "head: cannot open '%s' for reading: %s\n", name, strerror(errs[i]));
+        } else {
+            fprintf(stderr, "%s: %s: %s\n", args[0], name, strerror(errs[i]));
+        }
+        ret = 1;
+    }
+
+    // Like coreutils: wc is wide enough for the total size of the files
+    int width = 1;
+    if (strcmp(args[0], "wc") == 0 && (o.lines + o.words + o.bytes > 1 || num_files > 1) && fds[0] != -1) {
+        for (; size >= 10; size /= 10) {
+            width++;
+        }
+    }
+
+    // A signal now only sets native_intr, which the loops below check
+    signals_init();
+    native_intr = 0;
+    native_active = 1;
+    wc_counts total = { 0, 0, 0 };
+    for (int i = 0; i < (num_files > 0 ? num_files : 1); i++) {
+        const char *name = num_files > 0 ? args[o.first_file + i] : NULL;
+        if (fds[i] == -1 || native_intr) {
+            if (fds[i] != -1 && fds[i] != in) {
+                close(fds[i]);
+            }
+            continue;
+        }
+        int r;
+        if (strcmp(args[0], "wc") == 0) {
+            wc_counts c;
+            r = wc_fd(fds[i], &o, &c);
+            if (r == 0 && !native_intr) {
+                wc_print(&o, &c, width, name);
+                total.lines += c.lines;
+                total.words += c.words;
+                total.bytes += c.bytes;
+            }
+        } else {
+            if (strcmp(args[0], "head") == 0 && num_files > 1) {
+                printf("%s==> %s <==\n", i > 0 ? "\n" : "", strcmp(name, "-") == 0 ? "standard input" : name);
+            }
+            if (strcmp(args[0], "cat") == 0) {
+                r = out_copy(fds[i], -1);
+            } else {
+                r = o.by_bytes ? out_copy(fds[i], o.count) : head_lines(fds[i], o.count);
+            }
+        }
+        if (r == -1) {
+            fprintf(stderr, "%s: %s: %s\n", args[0], name != NULL ? name : "-", strerror(errno));
+            ret = 1;
+        }
+        if (fds[i] != in) {
+            close(fds[i]);
+        }
+    }
+    native_active = 0;
+    if (native_intr) {
+        if (headless && native_intr != SIGINT) {
+            // TERM, HUP and QUIT were for the shell, which has no child to pass them to
+            signal(native_intr, SIG_DFL);
+            raise(native_intr);
+        }
+        // Like a child killed by the signal
+        return 128 + native_intr;
+    }
+    if (strcmp(args[0], "wc") == 0 && num_files > 1) {
+        wc_print(&o, &total, width, "total");
+    }
+
+    return ret;
+}
+
+// Built-ins that only print, or whose state lives in the shell, so $(...) runs them in the shell itself
+static int output_only_builtin(char **args, int num_args) {
+    native_opts o;
+
+    if (strcmp(args[0], "cat") == 0 || strcmp(args[0], "head") == 0 || strcmp(args[0], "wc") == 0) {
+        return native_parse(args, num_args, &o) == 0;
+    }
+    return strcmp(args[0], "jobs") == 0 || strcmp(args[0], "history") == 0
+        || strcmp(args[0], "recv") == 0 || strcmp(args[0], "send") == 0
+        || ((strcmp(args[0], "export") == 0 || strcmp(args[0], "limit") == 0
+            || strcmp(args[0], "prio") == 0 || strcmp(args[0], "spool") == 0) && num_args == 1);
+}
+
+// Run cmd and capture its standard output. Built-ins that only print run
+// in-process into a memory stream; anything else runs in a child through a pipe
+int command_subst(char *cmd, capture *out) {
+    char **args;
+    int num_args;
+    char *copy = strdup(cmd);
+
+    if (copy == NULL) {
+        return -1;
+    }
+    // Splitting runs any nested $(...), and the child would run it again, so those always fork
+    if (strchr(copy, ';') == NULL && strchr(copy, '|') == NULL && strstr(copy, "$(") == NULL
+        && sepArgs(copy, &args, &num_args) == 0) {
+        int inproc = num_args > 0 && output_only_builtin(args, num_args);
+        if (inproc) {
+            FILE *mem = open_memstream(&out->buf, &out->len);
+            if (mem != NULL) {
+                FILE *saved = stdout;
+                stdout = mem;
+                execute(args, num_args);
+                stdout = saved;
+                fclose(mem);
+            }
+        }
+        for (int i = 0; i < num_args; i++) {
+            free(args[i]);
+        }
+        free(args);
+        if (inproc) {
+            free(copy);
+            goto strip;
+        }
+    }
+    free(copy);
+
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) == -1) {
+        perror("pipe");
+        return -1;
+    }
+    fcntl(pipefd[0], F_SETPIPE_SZ, 1 << 20); // Fewer wakeups for big outputs; best effort
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
+    } else if (pid == 0) { // Child runs the command line like a subshell
+        subshell_init();
+        dup2(pipefd[1], STDOUT_FILENO);
+        _exit(run_line(cmd));
+    }
+    close(pipefd[1]);
+
+    // Read in large chunks straight into the growing buffer
+    while (1) {
+        if (out->cap - out->len < 64 * 1024) {
+            size_t c = out->cap ? out->cap * 2 : 128 * 1024;
+            char *b = realloc(out->buf, c);
+            if (b == NULL) {
+                break;
+            }
+            out->buf = b;
+            out->cap = c;
+        }
+        ssize_t n = read(pipefd[0], out->buf + out->len, out->cap - out->len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        out->len += n;
+    }
+    close(pipefd[0]);
+    int status;
+    waitpid(pid, &status, 0);
+
+strip:
+    while (out->len > 0 && out->buf[out->len - 1] == '\n') { // Trailing newlines are dropped
+        out->len--;
+    }
+
+    return 0;
+}
+
+// Execute command
+int execCMD(char **args, int num_args) {
+    pid_t pid;
+    int isBG = 0;
+    limits lim;
+
+    // Trailing & runs the command as a background job
+    if (num_args > 1 && strcmp(args[num_args - 1], "&") == 0) {
+        isBG = 1;
+        args[--num_args] = NULL;
+    }
+
+    // Tightest of the shell defaults and this command's limits
+    for (int i = 0; i < NUM_LIMITS; i++) {
+        lim.value[i] = default_limits.value[i] < cmd_limits.value[i] ? default_limits.value[i] : cmd_limits.value[i];
+    }
+
+    // With every slot taken, a background job waits its turn
+    if (isBG && starting_job < 0 && !in_pipeline && max_jobs > 0 && slots_used() >= max_jobs) {
+        return queue_job(args, num_args, &lim);
+    }
+
+    // Spooled background jobs write to a pipe the writer thread drains
+    int out[2] = { -1, -1 };
+    if (isBG && !in_pipeline) {
+        spool_pipe(out);
+    }
+
+    // Headless, only timeouts and background jobs get their own process group, so
+    // the timer or a cancel can signal everything they started
+    int own_group = !in_pipeline && (!headless || cmd_timeout.duration > 0 || isBG);
+
+    // Nothing runs after a lone -c command, so it can replace the shell, as in sh
+    int in_place = exec_in_place && !isBG && cmd_timeout.duration == 0;
+    for (int i = 0; i < NUM_LIMITS; i++) {
+        in_place &= lim.value[i] == RLIM_INFINITY; // Reporting a limit kill needs a parent
+    }
+    if (!in_place) {
+        signals_init();
+    }
+
+    // Set signal handlers for SIGINT and SIGTSTP to default. Headless handlers are reset by exec anyway
+    if (!headless) {
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+    }
+    
+    struct timespec spawn_start;
+    clock_gettime(CLOCK_MONOTONIC, &spawn_start);
+    pid = in_place ? 0 : fork(); // Fork
+
+    if (pid < 0) { // Fork error
+        perror("fork");
+        exit(-1);
+    } else if (pid == 0) { // Child process
+        if (own_group && !in_place && (headless || getpid() != getsid(0))) {
+            // The shell is not a session leader
+            setpgid(0,0); // Set process group ID to new process group
+        }
+        // setpgid(0,0); // Set process group ID to new process group
+        apply_limits(&lim);
+        apply_prio(current_prio());
+
+        if (cmd_stdin != -1) {
+            dup2(cmd_stdin, STDIN_FILENO);
+        }
+        if (out[1] != -1) {
+            dup2(out[1], STDOUT_FILENO);
+            dup2(out[1], STDERR_FILENO);
+        }
+
+        // VAR=x prefixes only change this child's copy of the variables
+        for (int i = 0; i < num_cmd_assigns; i++) {
+            char *eq = strchr(cmd_assigns[i], '=');
+            var_set(cmd_assigns[i], eq - cmd_assigns[i], eq + 1, 1);
+        }
+
+        // Execute command
+        execSearch(args, var_envp());
+        perror("execvp"); // If execSearch() returns, error
+        _exit(-1);
+    } else { // Parent process
+        int ret = 0;
+        metrics_spawn(&spawn_start);
+        if (own_group) {
+            setpgid(pid, pid); // Also set here so the group exists before anyone signals it
+            if (cmd_timeout.duration > 0) {
+                timer_add(pid, &cmd_timeout);
+            }
+        }
+
+        if (!isBG) { // If foreground
+            int status;
+            struct rusage ru;
+            fg_children[0] = pid;
+            num_fg_children = 1;
+            metrics_jobs();
+            wait4(pid, &status, 0, &ru); // Wait for child process to finish
+            num_fg_children = 0;
+            metrics_jobs();
+            if (!WIFSTOPPED(status)) {
+                metrics_reaped(&ru);
+            }
+            // If child process was stopped, add it to the list of background jobs
+            if (WIFSTOPPED(status)) { 
+                add_job(pid, args[0], 1);
+                jobs[num_jobs - 1].lim = lim;
+            }
+            int hit = limit_killed(&lim, status, &ru);
+            if (WIFEXITED(status)) {
+                ret = WEXITSTATUS(status);
+            } else if (WIFSIGNALED(status)) {
+                ret = 128 + WTERMSIG(status);
+            } else {
+                ret = 128 + WSTOPSIG(status);
+            }
+            if (!WIFSTOPPED(status) && timer_remove(pid)) {
+                printf("%s: timed out\n", args[0]);
+                ret = STATUS_TIMEOUT;
+            } else if (hit >= 0) {
+                printf("%s: killed: %s limit\n", args[0], limit_names[hit]);
+            } else if (WIFSIGNALED(status) && lim.value[LIMIT_AS] != RLIM_INFINITY) {
+                // No sign that the cap did it, so name the signal instead
+                printf("%s: killed: %s\n", args[0], strsignal(WTERMSIG(status)));
+            }
+        } else if (starting_job >= 0) { // Queued job taking its slot
+            jobs[starting_job].pid = pid;
+            jobs[starting_job].state = JOB_RUNNING;
+            metrics_jobs();
+        } else { // Background job
+            // Add the job to the list of background jobs
+            add_job(pid, args[0], 1);
+            jobs[num_jobs - 1].lim = lim;
+            jobs[num_jobs - 1].slot = 1;
+        }
+        if (out[1] != -1) {
+            close(out[1]);
+            spool_add(out[0], pid, args[0], starting_job >= 0 ? jobs[starting_job].id : jobs[num_jobs - 1].id);
+        }
+        // waitpid(pid, &status, 0);
+        return ret;
+    }
+
+    return 0;
+}
+
+// Run an external command while stdout is a memory stream. Its output goes
+// to a memfd while it runs, then into the stream, so a big output can't fill
+// a pipe nobody is reading yet
+static int capture_exec(char **args, int num_args) {
+    int fd = memfd_create("wsh-capture", MFD_CLOEXEC);
+    int saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+
+    if (fd == -1 || saved == -1) {
+        perror("memfd_create");
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    dup2(fd, STDOUT_FILENO);
+    int ret = execCMD(args, num_args);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+
+    char buf[65536];
+    ssize_t n;
+    lseek(fd, 0, SEEK_SET);
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        fwrite(buf, 1, n, stdout);
+    }
+    close(fd);
+
+    return ret;
+}
+
+// Execute cmd. First checks for built-in cmds. If not, passes to execCMD()
+int execute(char **args, int num_args) {
+    // Heredocs and here-strings become the command's stdin
+    for (int i = 0; i < num_args; i++) {
+        if (strncmp(args[i], "<<", 2) == 0) {
+            int fd = take_redirects(args, &num_args);
+            if (num_args == 0) {
+                if (fd != -1) {
+                    close(fd);
+                }
+                return 0;
+            }
+            int saved = cmd_stdin;
+            cmd_stdin = fd;
+            int ret = execute(args, num_args);
+            cmd_stdin = saved;
+            if (fd != -1) {
+                close(fd);
+            }
+            return ret;
+        }
+    }
+
+    // Leading VAR=x words: on their own they set shell variables, otherwise they go to the command
+    int assigns = 0;
+    while (assigns < num_args && strchr(args[assigns], '=') != NULL
+            && var_name_ok(args[assigns], strchr(args[assigns], '=') - args[assigns])) {
+        assigns++;
+    }
+    if (assigns == num_args) {
+        for (int i = 0; i < assigns; i++) {
+            char *eq = strchr(args[i], '=');
+            var_set(args[i], eq - args[i], eq + 1, 0);
+        }
+        return 0;
+    } else if (assigns > 0) {
+        char **saved = cmd_assigns;
+        int num_saved = num_cmd_assigns;
+        cmd_assigns = args;
+        num_cmd_assigns = assigns;
+        int ret = execute(args + assigns, num_args - assigns);
+        cmd_assigns = saved;
+        num_cmd_assigns = num_saved;
+        return ret;
+    }
+
+    // Built-in Commands
+    if (strcmp(args[0], "true") == 0 || strcmp(args[0], ":") == 0) { // No exec for the commonest no-ops
+        return 0;
+    } else if (strcmp(args[0], "false") == 0) {
+        return 1;
+    } else if(strcmp(args[0], "cd") == 0) { // cd built-in command
+        // Checking num args
+        if (num_args != 2) {
+            printf("cd: invalid arguments\n");
+            return -1;
+        }
+        if (chdir(args[1]) == -1) { // Using chdir() with passed arg. If return, error
+            perror("chdir");
+            return -1;
+        }
+
+        return 0;
+    } else if (strcmp(args[0], "jobs") == 0) { // jobs built-in command
+        return jobs_builtin(args, num_args);
+    } else if (strcmp(args[0], "wait") == 0) { // wait built-in command
+        if (num_args > 1) {
+            printf("wait: too many arguments\n");
+            return -1;
+        }
+        return wait_jobs();
+    } else if (strcmp(args[0], "fg") == 0) { // fg built-in command
+        if (num_args > 2) {
+            perror("fg: too many arguments\n");
+            return -1;
+        }
+        int id = num_jobs;
+        if (num_args == 2) {
+            id = atoi(args[1]); // Parse job ID to int
+
+            // If job ID is invalid, error
+            if (id <= 0 || id > num_jobs) { 
+                perror("fg: invalid job id\n");
+                return -1;
+            }
+        }
+        if (jobs[id - 1].state == JOB_QUEUED) { // Skip the queue
+            job_start(id - 1);
+        }
+        job j = jobs[id - 1]; // Get job with given ID
+        remove_job(id); // Remove job from list of background jobs
+        set_foreground(j.pid); // Set job to foreground
+
+        return 0;
+    } else if (strcmp(args[0], "bg") == 0) { // bg built-in command
+        if (num_args > 2) {
+            perror("bg: too many arguments\n");
+            return -1;
+        }
+
+        int id = num_jobs; // Default to last job
+        if (num_args == 2) {
+            id = atoi(args[1]); // Parse job ID to int
+
+            // If job ID is invalid, error
+            if (id <= 0 || id > num_jobs) { 
+                perror("bg: invalid job id\n");
+                return -1;
+            }
+        }
+        if (jobs[id - 1].state == JOB_QUEUED) { // Skip the queue
+            job_start(id - 1);
+            return 0;
+        }
+        job j = jobs[id - 1]; // Get job with given ID
+        // remove_job(id); 
+        set_background(j.pid); // Set job to background
+        
+        return 0;
+    } else if (strcmp(args[0], "limit") == 0) { // limit built-in command
+        return limit_builtin(args, num_args);
+    } else if (strcmp(args[0], "timeout") == 0) { // timeout built-in command
+        return timeout_builtin(args, num_args);
+    } else if (strcmp(args[0], "prio") == 0) { // prio built-in command
+        return prio_builtin(args, num_args);
+    } else if (strcmp(args[0], "spool") == 0) { // spool built-in command
+        return spool_builtin(args, num_args);
+    } else if (strcmp(args[0], "history") == 0) { // history built-in command
+        return history_builtin(args, num_args);
+    } else if (strcmp(args[0], "export") == 0) { // export built-in command
+        return export_builtin(args, num_args);
+    } else if (strcmp(args[0], "unset") == 0) { // unset built-in command
+        return unset_builtin(args, num_args);
+    } else if (strcmp(args[0], "break") == 0 || strcmp(args[0], "continue") == 0) { // Loop control
+        return loop_ctl_builtin(args, num_args);
+    } else if (strcmp(args[0], "set") == 0) { // set built-in command
+        return set_builtin(args, num_args);
+    } else if (strcmp(args[0], "coproc") == 0) { // coproc built-in command
+        return coproc_builtin(args, num_args);
+    } else if (strcmp(args[0], "send") == 0) { // send built-in command
+        return send_builtin(args, num_args);
+    } else if (strcmp(args[0], "recv") == 0) { // recv built-in command
+        return recv_builtin(args, num_args);
+    }
+
+    // cat, head and wc run in-process unless they need the real tool
+    if (strcmp(args[0], "cat") == 0 || strcmp(args[0], "head") == 0 || strcmp(args[0], "wc") == 0) {
+        int ret = file_builtin(args, num_args);
+        if (ret != NATIVE_FALLBACK) {
+            return ret;
+        }
+        if (fileno(stdout) == -1) { // In-process $(...): the tool's output has to land in the capture too
+            return capture_exec(args, num_args);
+        }
+    }
+
+    // Other exec program
+    int a = execCMD(args, num_args);
+    return a;
+    
+    return 0;
+}
+
+// Execute pipe
+int execPipe(char **args, int num_args, char **pipedArgs, int numPipedArgs) {
+    int pipefd[2]; // pipefd[0] is read end, pipefd[1] is write end
+    if (pipe(pipefd) == -1) {
+        perror("pipe");
+        exit(-1);
+    }
+
+    //printf("%d, and %d", pipefd[0], pipefd[1]);
+
+    signals_init();
+
+    // Both sides run in the first child's process group so they can be signalled together
+    struct timespec spawn_start;
+    clock_gettime(CLOCK_MONOTONIC, &spawn_start);
+    int own_group = !headless || cmd_timeout.duration > 0;
+    int pid = fork();
+    int pgid = pid;
+    if (pid == 0){ // Child
+        subshell_init();
+        if (own_group) {
+            setpgid(0, 0);
+        }
+        dup2(pipefd[1], STDOUT_FILENO); // Redirect stdout to pipe
+        close(pipefd[1]); // Close write end
+        close(pipefd[0]); // Close read end
+        int ret = execute(args, num_args); // Execute first command
+
+        _exit(ret < 0 ? 1 : ret); // _exit so the shell's buffered stdin isn't rewound
+    } else { // Parent
+        metrics_spawn(&spawn_start);
+        if (own_group) {
+            setpgid(pgid, pgid);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &spawn_start);
+        pid = fork(); // Fork again because we need two processes
+
+        if(pid == 0) { // Child
+            subshell_init();
+            if (own_group) {
+                setpgid(0, pgid);
+            }
+            dup2(pipefd[0], STDIN_FILENO); // Redirect stdin to pipe
+            close(pipefd[0]); // Close read end
+            close(pipefd[1]); // Close write end
+            int ret = execute(pipedArgs, numPipedArgs); // Execute second command
+
+            _exit(ret < 0 ? 1 : ret);
+        } else { // parent
+            int status; 
+            struct rusage ru;
+            metrics_spawn(&spawn_start);
+            if (own_group) {
+                setpgid(pid, pgid);
+            }
+            if (cmd_timeout.duration > 0) {
+                timer_add(pgid, &cmd_timeout);
+            }
+            close(pipefd[1]); // Close write end
+            close(pipefd[0]); // Close read end
+            fg_children[0] = pgid;
+            fg_children[1] = pid;
+            num_fg_children = 2;
+            metrics_jobs();
+            wait4(pid, &status, 0, &ru); // Wait for child process to finish
+            metrics_reaped(&ru);
+            int first;
+            wait4(pgid, &first, 0, &ru); // Reap the first command too
+            metrics_reaped(&ru);
+            num_fg_children = 0;
+            metrics_jobs();
+            if (timer_remove(pgid)) {
+                printf("%s: timed out\n", args[0]);
+                return STATUS_TIMEOUT;
+            }
+            // Status of the pipeline is the status of its last command
+            return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        } 
+    }
+
+    return 0;
+}
+
+// Copy the producer's output to every consumer without it passing through
+// userspace. Each consumer has a staging pipe: the next chunk is tee(2)'d from
+// the producer into every (empty) staging pipe, so it always fits whole, then
+// splice(2) moves it on to the consumer at the consumer's own pace. A new
+// chunk is only taken once every consumer has drained the last one, so a slow
+// consumer holds back the producer instead of growing a buffer
+static void fanout_copy(int in, int *stage_r, int *stage_w, int *out, int n) {
+    size_t queued[MAX_FANOUT] = { 0 };
+    int active = n, eof = 0;
+    struct pollfd pfd[MAX_FANOUT];
+
+    // Consumers that exit show up as EPIPE rather than SIGPIPE
+    sigset_t pipe_set, old;
+    sigemptyset(&pipe_set);
+    sigaddset(&pipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_set, &old);
+
+    while (active > 0) {
+        // Drain the staging pipes into the consumers
+        int waiting = 0;
+        for (int i = 0; i < n; i++) {
+            if (out[i] == -1 || queued[i] == 0) {
+                continue;
+            }
+            ssize_t r = splice(stage_r[i], NULL, out[i], NULL, queued[i], SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (r > 0) {
+                queued[i] -= r;
+            } else if (r == -1 && (errno == EAGAIN || errno == EINTR)) {
+                // Consumer's pipe is full
+            } else { // Consumer has gone
+                close(out[i]);
+                out[i] = -1;
+                queued[i] = 0;
+                active--;
+                continue;
+            }
+            if (queued[i] > 0) {
+                pfd[waiting].fd = out[i];
+                pfd[waiting].events = POLLOUT;
+                waiting++;
+            }
+        }
+        if (waiting > 0) {
+            poll(pfd, waiting, -1);
+            continue;
+        }
+        if (eof || active == 0) {
+            break;
+        }
+
+        // Every staging pipe is empty: take the next chunk from the producer
+        int first = -1, last = -1;
+        for (int i = 0; i < n; i++) {
+            if (out[i] != -1) {
+                first = first == -1 ? i : first;
+                last = i;
+            }
+        }
+        ssize_t len;
+        if (first == last) { // Only one consumer left, nothing to duplicate
+            len = splice(in, NULL, stage_w[last], NULL, 1 << 30, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        } else {
+            len = tee(in, stage_w[first], 1 << 30, SPLICE_F_NONBLOCK);
+        }
+        if (len == -1 && (errno == EAGAIN || errno == EINTR)) {
+            pfd[0].fd = in;
+            pfd[0].events = POLLIN;
+            poll(pfd, 1, -1);
+            continue;
+        }
+        if (len <= 0) { // Producer finished
+            eof = 1;
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            if (out[i] == -1) {
+                continue;
+            }
+            if (first != last && i != first) {
+                // The staging pipe is empty and as large as the input, so this can't come up short
+                ssize_t r = i == last ? splice(in, NULL, stage_w[i], NULL, len, SPLICE_F_MOVE)
+                    : tee(in, stage_w[i], len, 0);
+                if (r != len) {
+                    perror("tee");
+                    eof = 1;
                 }
+            }
+            queued[i] = len;
+        }
+    }
+
+    struct timespec zero = { 0, 0 };
+    while (sigtimedwait(&pipe_set, NULL, &zero) > 0) {
+        // Discard SIGPIPEs raised by consumers that went away
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+// Run producer with its output copied to each of the n consumer command lines.
+// Returns the status of the last consumer
+int execFanout(char **args, int num_args, char ***consumers, int *num_consumer_args, int n) {
+    int prod[2], stage[MAX_FANOUT][2], cons[MAX_FANOUT][2];
+    int stage_r[MAX_FANOUT], stage_w[MAX_FANOUT], out[MAX_FANOUT];
+    pid_t pids[MAX_FANOUT + 1];
+    int num_pipes = 0;
+    int *fds[2 * MAX_FANOUT + 1];
+
+    signals_init();
+
+    // The shell keeps its ends across the forks, so every pipe is close-on-exec
+    if (pipe2(prod, O_CLOEXEC) == -1) {
+        perror("pipe");
+        return -1;
+    }
+    fds[num_pipes++] = prod;
+    int size = fcntl(prod[0], F_SETPIPE_SZ, 1 << 20) == -1 ? fcntl(prod[0], F_GETPIPE_SZ) : 1 << 20;
+    for (int i = 0; i < n; i++) {
+        if (pipe2(stage[i], O_CLOEXEC) == -1) {
+            goto fail;
+        }
+        fds[num_pipes++] = stage[i];
+        if (pipe2(cons[i], O_CLOEXEC) == -1) {
+            goto fail;
+        }
+        fds[num_pipes++] = cons[i];
+        // Staging pipes must hold anything the producer pipe does
+        if (fcntl(stage[i][0], F_SETPIPE_SZ, size) < size) {
+            size = fcntl(stage[i][0], F_GETPIPE_SZ);
+            fcntl(prod[0], F_SETPIPE_SZ, size);
+        }
+        fcntl(cons[i][0], F_SETPIPE_SZ, 1 << 20); // Best effort
+    }
+
+    // Everything runs in the producer's process group, like a pipeline
+    int own_group = !headless || cmd_timeout.duration > 0;
+    pid_t pgid = 0;
+    for (int i = 0; i <= n; i++) {
+        struct timespec spawn_start;
+        clock_gettime(CLOCK_MONOTONIC, &spawn_start);
+        pid_t pid = fork();
+        if (pid < 0) {
+            // Stop the stages already running; they can't be fed or drained
+            perror("fork");
+            if (own_group && pgid > 0) {
+                kill(-pgid, SIGKILL); // Takes the commands they started too
+            }
+            for (int j = 0; j < i; j++) {
+                kill(pids[j], SIGKILL);
+            }
+            for (int j = 0; j < i; j++) {
+                struct rusage ru;
+                wait4(pids[j], NULL, 0, &ru);
+                metrics_reaped(&ru);
+            }
+            goto close_pipes;
+        } else if (pid == 0) { // Child: the producer first, then the consumers
+            subshell_init();
+            if (own_group) {
+                setpgid(0, pgid);
+            }
+            dup2(i == 0 ? prod[1] : cons[i - 1][0], i == 0 ? STDOUT_FILENO : STDIN_FILENO);
+            for (int j = 0; j < num_pipes; j++) {
+                close(fds[j][0]);
+                close(fds[j][1]);
+            }
+            int ret = i == 0 ? execLine(args, num_args) : execLine(consumers[i - 1], num_consumer_args[i - 1]);
+
+            _exit(ret < 0 ? 1 : ret); // _exit so the shell's buffered stdin isn't rewound
+        }
+        metrics_spawn(&spawn_start);
+        pgid = i == 0 ? pid : pgid;
+        if (own_group) {
+            setpgid(pid, pgid);
+        }
+        pids[i] = pid;
+    }
+    if (cmd_timeout.duration > 0) {
+        timer_add(pgid, &cmd_timeout);
+    }
+
+    close(prod[1]);
+    for (int i = 0; i < n; i++) {
+        close(cons[i][0]);
+        stage_r[i] = stage[i][0];
+        stage_w[i] = stage[i][1];
+        out[i] = cons[i][1];
+    }
+    for (int i = 0; i <= n; i++) {
+        fg_children[i] = pids[i];
+    }
+    num_fg_children = n + 1;
+    metrics_jobs();
+
+    fanout_copy(prod[0], stage_r, stage_w, out, n);
+
+    // Closing the consumers' pipes gives them EOF; closing ours stops a producer nobody reads
+    close(prod[0]);
+    for (int i = 0; i < n; i++) {
+        close(stage_r[i]);
+        close(stage_w[i]);
+        if (out[i] != -1) {
+            close(out[i]);
+        }
+    }
+
+    int status = 0;
+    for (int i = 0; i <= n; i++) {
+        int s;
+        struct rusage ru;
+        wait4(pids[i], &s, 0, &ru);
+        metrics_reaped(&ru);
+        if (i == n) {
+            status = s;
+        }
+    }
+    num_fg_children = 0;
+    metrics_jobs();
+    if (timer_remove(pgid)) {
+        printf("%s: timed out\n", args[0]);
+        return STATUS_TIMEOUT;
+    }
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+
+fail:
+    perror("pipe");
+close_pipes:
+    for (int j = 0; j < num_pipes; j++) {
+        close(fds[j][0]);
+        close(fds[j][1]);
+    }
+    return -1;
+}
+
+// Split the consumer list after |& at args[op] and run the fan-out. Consumers
+// are comma separated inside braces, with or without spaces around them
+static int fanoutLine(char **args, int num_args, int op) {
+    char *words[2 * num_args]; // Consumer words, each list NULL terminated
+    char **consumers[MAX_FANOUT];
+    int num_consumer_args[MAX_FANOUT];
+    int n = 0, num_words = 0, closed = 0;
+
+    if (op == 0 || op + 1 >= num_args || args[op + 1][0] != '{') {
+        printf("wsh: usage: COMMAND |& {A, B, ...}\n");
+        return -1;
+    }
+    consumers[0] = words;
+    num_consumer_args[0] = 0;
+    for (int j = op + 1; j < num_args; j++) {
+        if (closed) {
+            printf("wsh: unexpected %s after }\n", args[j]);
+            return -1;
+        }
+        char *w = j == op + 1 ? args[j] + 1 : args[j]; // Past the {
+        size_t len = strlen(w);
+        int end = 0;
+        if (len > 0 && w[len - 1] == '}') {
+            closed = 1;
+            w[--len] = '\0';
+        } else if (len > 0 && w[len - 1] == ',') {
+            end = 1;
+            w[--len] = '\0';
+        }
+        if (len > 0) {
+            words[num_words++] = w;
+            num_consumer_args[n]++;
+        }
+        if (end || closed) { // Finish this consumer
+            if (num_consumer_args[n] == 0) {
+                printf("wsh: empty command in |& list\n");
+                return -1;
+            }
+            words[num_words++] = NULL;
+            if (closed) {
+                n++;
+            } else if (++n == MAX_FANOUT) {
+                printf("wsh: too many consumers\n");
+                return -1;
+            } else {
+                consumers[n] = words + num_words;
+                num_consumer_args[n] = 0;
+            }
+        }
+    }
+    if (!closed) {
+        printf("wsh: missing } after |&\n");
+        return -1;
+    }
+    args[op] = NULL;
+
+    return execFanout(args, op, consumers, num_consumer_args, n);
+}
+
+// Execute a command line that may contain a pipe
+int execLine(char **args, int num_args) {
+    int hasPipe = 0;
+    int pipeInd = -1;
+
+    // timeout and prio apply to the whole pipeline, so handle them before splitting
+    if (strcmp(args[0], "timeout") == 0) {
+        return timeout_builtin(args, num_args);
+    } else if (strcmp(args[0], "prio") == 0) {
+        return prio_builtin(args, num_args);
+    }
+
+    // PRODUCER |& {A, B, ...} copies the producer's output to every consumer
+    for (int j = 0; j < num_args; j++) {
+        if (strcmp(args[j], "|&") == 0) {
+            return fanoutLine(args, num_args, j);
+        }
+    }
+
+    // Check for pipe
+    for (int j = 0; j < num_args; j++) {
+        if (strcmp(args[j], "|") == 0) {
+            hasPipe = 1;
+            pipeInd = j;
+            break;
+        }
+    }
+    // Pipe
+    if (hasPipe == 1) {
+        int numPrePipedArgs = pipeInd; // Num args before pipe
+        char *prePipedArgs[numPrePipedArgs + 1]; // List of args before pipe
+        // Add args before pipe to list
+        for (int j = 0; j < numPrePipedArgs; j++) { 
+            prePipedArgs[j] = args[j];
+        }
+        prePipedArgs[numPrePipedArgs] = NULL; // Set last arg to NULL
+        int numPipedArgs = (num_args - pipeInd) - 1; // Numargs after pipe
+        char *pipedArgs[numPipedArgs + 1]; // List of args after pipe
+        // Add args after pipe to list
+        for (int j = 0; j < numPipedArgs; j++) {
+            pipedArgs[j] = args[j + pipeInd + 1];
+        }
+        pipedArgs[numPipedArgs] = NULL; // Set last arg to NULL
+        args[pipeInd] = NULL; // Set pipe arg to NULL
+        num_args = pipeInd; // Set num args to num args before pipe
+
+        return execPipe(prePipedArgs, numPrePipedArgs, pipedArgs, numPipedArgs);
+    }
+    // Otherwise, execute the command as normal
+    else {
+        return execute(args, num_args);
+    }
+}
+
+// Stop every job: SIGTERM, then SIGKILL for anything still alive after grace seconds
+void cancel_jobs(double grace) {
+    struct pollfd pfd[MAX_JOBS];
+    pid_t unwatched[MAX_JOBS]; // Jobs pidfd_open failed for, checked every 10ms instead
+    int n = 0, num_unwatched = 0;
+
+    for (int i = num_jobs - 1; i >= 0; i--) { // Queued jobs never start
+        if (jobs[i].state == JOB_QUEUED) {
+            remove_job(jobs[i].id);
+        }
+    }
+    update_jobs();
+    for (int i = 0; i < num_jobs; i++) {
+        if (jobs[i].state != JOB_RUNNING && jobs[i].state != JOB_STOPPED) {
+            continue;
+        }
+        // A pidfd becomes readable when the process exits, so the wait needs no polling loop
+        pfd[n].fd = syscall(SYS_pidfd_open, jobs[i].pid, 0);
+        pfd[n].events = POLLIN;
+        if (pfd[n].fd >= 0) {
+            n++;
+        } else {
+            unwatched[num_unwatched++] = jobs[i].pid;
+        }
+        signal_job(jobs[i].pid, SIGTERM);
+        signal_job(jobs[i].pid, SIGCONT); // Stopped jobs need to run to see it
+    }
+
+    struct timespec deadline = deadline_after(grace), now;
+    int left = n + num_unwatched;
+    while (left > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (!ts_before(&now, &deadline)) {
+            break;
+        }
+        long ms = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000 + 1;
+        if (num_unwatched > 0 && ms > 10) {
+            ms = 10;
+        }
+        int ready = poll(pfd, n, ms);
+        for (int i = 0; i < num_unwatched; i++) {
+            // WNOWAIT leaves the zombie for update_jobs to reap
+            siginfo_t info = { 0 };
+            if (unwatched[i] > 0 && waitid(P_PID, unwatched[i], &info, WEXITED | WNOHANG | WNOWAIT) == 0 && info.si_pid != 0) {
+                unwatched[i] = 0;
+                left--;
+            }
+        }
+        if (ready <= 0) {
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            if (pfd[i].fd >= 0 && pfd[i].revents != 0) {
+                close(pfd[i].fd);
+                pfd[i].fd = -1; // poll skips it from now on
+                left--;
+            }
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        if (pfd[i].fd >= 0) {
+            close(pfd[i].fd);
+        }
+    }
+
+    update_jobs();
+    for (int i = 0; i < num_jobs; i++) {
+        if (jobs[i].state == JOB_RUNNING || jobs[i].state == JOB_STOPPED) {
+            signal_job(jobs[i].pid, SIGKILL);
+            waitpid(jobs[i].pid, NULL, 0);
+        }
+    }
+    update_jobs();
+}
+
+// set -e / set +e: stop at the first failing command, cancelling background jobs
+int set_builtin(char **args, int num_args) {
+    if (num_args == 1) {
+        printf("errexit\t%s\n", errexit ? "on" : "off");
+        return 0;
+    }
+    for (int i = 1; i < num_args; i++) {
+        if (strcmp(args[i], "-e") == 0) {
+            errexit = 1;
+        } else if (strcmp(args[i], "+e") == 0) {
+            errexit = 0;
+        } else {
+            printf("Usage: set [-e | +e]\n");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Next && or || in cmd outside $(...), or NULL
+static char *find_list_op(char *cmd) {
+    int depth = 0;
+
+    for (char *p = cmd; *p != '\0'; p++) {
+        if (*p == '$' && p[1] == '(') {
+            depth++;
+            p++;
+        } else if (*p == ')' && depth > 0) {
+            depth--;
+        } else if (depth == 0 && ((p[0] == '&' && p[1] == '&') || (p[0] == '|' && p[1] == '|'))) {
+            return p;
+        }
+    }
+
+    return NULL;
+}
+
+// Run a command list joined by && and ||. Each command is split into words
+// just before it runs, so $? is the status of the one before. *guarded is set
+// when the last command run wasn't the list's last, so its failure doesn't trip set -e
+int execList(char *cmd, int *guarded) {
+    char **args;
+    int num_args;
+    int status = last_status, run = 1;
+
+    // Every command around an operator must be there before anything runs
+    for (char *seg = cmd, *op; ; seg = op + 2) {
+        op = find_list_op(seg);
+        char *end = op != NULL ? op : seg + strlen(seg);
+        while (seg < end && (*seg == ' ' || *seg == '\t' || *seg == '\n')) {
+            seg++;
+        }
+        if (seg == end && (op != NULL || seg != cmd)) {
+            printf("wsh: syntax error near %s\n", op != NULL ? (*op == '&' ? "&&" : "||") : "end of line");
+            return 2;
+        }
+        if (op == NULL) {
+            break;
+        }
+    }
+
+    *guarded = 0;
+    for (char *seg = cmd, *op; ; seg = op + 2) {
+        op = find_list_op(seg);
+        int and = op != NULL && *op == '&';
+        if (op != NULL) {
+            *op = '\0';
+        }
+        if (run) {
+            // Split command line into arguments
+            if (sepArgs(seg, &args, &num_args) == -1) {
+                status = 1;
+            } else if (num_args == 0) { // Skip if no args
+                free(args);
+            } else {
                 args[num_args] = NULL;
 
-                // Handle exit as built in command
-                if (strcmp(args[0], "exit") == 0) {
-                    exit(0);
-                }
+                // Handle exit as built in command
+                int ret = strcmp(args[0], "exit") == 0 ? exit_builtin(args, num_args) : execLine(args, num_args);
+                status = ret < 0 ? 1 : ret;
+            }
+            last_status = status;
+            *guarded = op != NULL;
+        }
+        if (op == NULL) {
+            break;
+        }
+        // a && b runs b only after success, a || b only after failure. Skipped
+        // commands pass the status on, so false && a || b runs b
+        run = and ? status == 0 : status != 0;
+    }
+
+    return status;
+}
+
+// Loops. A line containing for, while or until is parsed once into a tree of
+// nodes. Loop bodies then run from pre-split word templates, and only the
+// words that contain $ are substituted again on each pass
+static int loop_level = 0; // Loops currently running
+static int loop_break = 0, loop_continue = 0; // Levels still to break out of or continue
+
+// Split a line into words for the loop parser. ; and newlines become their own
+// words, except inside $(...). Returns the number of words, -1 on error
+static int loop_words(const char *line, char ***words) {
+    int n = 0, cap = 16;
+    const char *p = line;
+
+    *words = malloc(cap * sizeof(char *));
+    if (*words == NULL) {
+        return -1;
+    }
+    while (1) {
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        }
+        const char *start = p;
+        if (*p == ';' || *p == '\n') {
+            p++;
+        } else {
+            int depth = 0;
+            for (; *p != '\0'; p++) {
+                if (p[0] == '$' && p[1] == '(') {
+                    depth++;
+                    p++;
+                } else if (*p == ')' && depth > 0) {
+                    depth--;
+                } else if (depth == 0 && (*p == ' ' || *p == '\t' || *p == ';' || *p == '\n')) {
+                    break;
+                }
+            }
+        }
+        if (n + 1 >= cap) {
+            cap *= 2;
+            char **grown = realloc(*words, cap * sizeof(char *));
+            if (grown == NULL) {
+                return -1;
+            }
+            *words = grown;
+        }
+        (*words)[n] = strndup(start, p - start);
+        if ((*words)[n][0] == '\n') {
+            (*words)[n][0] = ';';
+        }
+        n++;
+    }
+    (*words)[n] = NULL;
+
+    return n;
+}
+
+static void free_words(char **words, int n) {
+    for (int i = 0; i < n; i++) {
+        free(words[i]);
+    }
+    free(words);
+}
+
+// Words where a new command starts, so for, while, do and done mean something there
+static int command_start(char **words, int i) {
+    return i == 0 || strcmp(words[i - 1], ";") == 0 || strcmp(words[i - 1], "&&") == 0
+        || strcmp(words[i - 1], "||") == 0 || strcmp(words[i - 1], "|") == 0
+        || strcmp(words[i - 1], "do") == 0;
+}
+
+static int loop_keyword(const char *w) {
+    return strcmp(w, "for") == 0 || strcmp(w, "while") == 0 || strcmp(w, "until") == 0;
+}
+
+// Loops opened in line and not yet closed by done. 0 for lines without loops
+int loop_depth(const char *line) {
+    char **words;
+    int depth = 0;
+
+    if (strstr(line, "for") == NULL && strstr(line, "while") == NULL && strstr(line, "until") == NULL) {
+        return 0;
+    }
+    int n = loop_words(line, &words);
+    for (int i = 0; i < n; i++) {
+        if (command_start(words, i)) {
+            depth += loop_keyword(words[i]);
+            depth -= strcmp(words[i], "done") == 0;
+        }
+    }
+    if (n >= 0) {
+        free_words(words, n);
+    }
+
+    return depth;
+}
+
+// Template for a run of words
+static void set_cmd_tmpl(cmd_tmpl *c, char **words, int n) {
+    size_t len = 0;
+
+    c->words = calloc(n, sizeof(word_tmpl));
+    for (int k = 0; k < n; k++) {
+        c->words[k].text = strdup(words[k]);
+        c->words[k].expand = strchr(words[k], '$') != NULL;
+        len += strlen(words[k]) + 1;
+        // $(...) output is split into words and heredocs are consumed, so those go through sepArgs each time
+        c->resplit |= strstr(words[k], "$(") != NULL || strncmp(words[k], "<<", 2) == 0;
+        // The command keeps its own copy of each heredoc body, for every pass
+        if (strncmp(words[k], "<<", 2) == 0 && words[k][2] != '<' && next_heredoc < num_heredocs) {
+            char **grown = realloc(c->heredocs, (c->num_heredocs + 1) * sizeof(char *));
+            if (grown != NULL) {
+                c->heredocs = grown;
+                c->heredocs[c->num_heredocs++] = strdup(heredocs[next_heredoc++]);
+            }
+        }
+    }
+    c->num_words = n;
+    c->text = malloc(len + 1);
+    c->text[0] = '\0';
+    for (int k = 0; k < n; k++) {
+        strcat(strcat(c->text, words[k]), " ");
+    }
+}
+
+static void free_cmd_tmpl(cmd_tmpl *c) {
+    for (int j = 0; j < c->num_words; j++) {
+        free(c->words[j].text);
+    }
+    free(c->words);
+    free(c->text);
+    for (int j = 0; j < c->num_heredocs; j++) {
+        free(c->heredocs[j]);
+    }
+    free(c->heredocs);
+}
+
+static void free_nodes(node *n) {
+    while (n != NULL) {
+        node *next = n->next;
+        for (int i = 0; i < n->num_cmds; i++) {
+            free_cmd_tmpl(&n->cmds[i]);
+        }
+        free(n->cmds);
+        free_cmd_tmpl(&n->items);
+        free(n->var);
+        free_nodes(n->cond);
+        free_nodes(n->body);
+        free(n);
+        n = next;
+    }
+}
+
+static node *parse_nodes(char **words, int n, int *i, const char *until, int *err);
+
+// An && / || list of commands, up to the next ;
+static node *parse_command(char **words, int n, int *i, int *err) {
+    node *nd = calloc(1, sizeof(node));
+    int start = *i;
+
+    nd->type = NODE_CMD;
+    while (*i < n && strcmp(words[*i], ";") != 0) {
+        (*i)++;
+    }
+    nd->cmds = calloc(*i - start + 1, sizeof(cmd_tmpl));
+    int op = 0;
+    for (int j = start; j <= *i; j++) {
+        int is_op = j < *i && (strcmp(words[j], "&&") == 0 || strcmp(words[j], "||") == 0);
+        if (j < *i && !is_op) {
+            continue;
+        }
+        if (j == start) {
+            printf("wsh: syntax error near %s\n", j < n ? words[j] : "end of line");
+            *err = 1;
+            return nd;
+        }
+        cmd_tmpl *c = &nd->cmds[nd->num_cmds++];
+        set_cmd_tmpl(c, words + start, j - start);
+        c->op = op;
+        op = is_op ? words[j][0] : 0;
+        start = j + 1;
+    }
+
+    return nd;
+}
+
+// One for, while or until loop
+static node *parse_loop(char **words, int n, int *i, int *err) {
+    node *nd = calloc(1, sizeof(node));
+    const char *kw = words[(*i)++];
+
+    if (strcmp(kw, "for") == 0) {
+        nd->type = NODE_FOR;
+        if (*i + 1 >= n || !var_name_ok(words[*i], strlen(words[*i])) || strcmp(words[*i + 1], "in") != 0) {
+            printf("wsh: usage: for NAME in WORDS...; do COMMANDS; done\n");
+            *err = 1;
+            return nd;
+        }
+        nd->var = strdup(words[*i]);
+        *i += 2;
+        int start = *i;
+        while (*i < n && strcmp(words[*i], ";") != 0) {
+            (*i)++;
+        }
+        set_cmd_tmpl(&nd->items, words + start, *i - start);
+        while (*i < n && strcmp(words[*i], ";") == 0) {
+            (*i)++;
+        }
+    } else {
+        nd->type = strcmp(kw, "while") == 0 ? NODE_WHILE : NODE_UNTIL;
+        nd->cond = parse_nodes(words, n, i, "do", err);
+    }
+    if (*err || *i >= n || strcmp(words[*i], "do") != 0) {
+        if (!*err) {
+            printf("wsh: missing do\n");
+        }
+        *err = 1;
+        return nd;
+    }
+    (*i)++;
+    nd->body = parse_nodes(words, n, i, "done", err);
+    if (*err || *i >= n) {
+        if (!*err) {
+            printf("wsh: missing done\n");
+        }
+        *err = 1;
+        return nd;
+    }
+    (*i)++;
+    if (*i < n && strcmp(words[*i], ";") != 0) {
+        printf("wsh: unexpected %s after done\n", words[*i]);
+        *err = 1;
+    }
+
+    return nd;
+}
+
+// Commands up to the word until (at the start of a command), or the end when until is NULL
+static node *parse_nodes(char **words, int n, int *i, const char *until, int *err) {
+    node *head = NULL, **tail = &head;
+
+    while (!*err) {
+        while (*i < n && strcmp(words[*i], ";") == 0) {
+            (*i)++;
+        }
+        if (*i >= n || (until != NULL && strcmp(words[*i], until) == 0)) {
+            break;
+        }
+        if (strcmp(words[*i], "done") == 0) { // done that closes nothing
+            printf("wsh: unexpected done\n");
+            *err = 1;
+            break;
+        }
+        *tail = loop_keyword(words[*i]) ? parse_loop(words, n, i, err) : parse_command(words, n, i, err);
+        tail = &(*tail)->next;
+    }
+
+    return head;
+}
+
+// Substitute variables into a template word and add it (or its glob matches) to args
+static int tmpl_expand(const word_tmpl *t, char ***args, int *num_args, size_t *cap) {
+    if (!t->expand) {
+        return add_word(args, num_args, cap, t->text, strlen(t->text));
+    }
+
+    char *w = NULL;
+    size_t len = 0, wcap = 0;
+    int ret = 0;
+    for (const char *p = t->text; *p != '\0' && ret == 0; ) {
+        char num[32];
+        const char *next;
+        const char *val = var_value(p, &next, num);
+        if (val != NULL) {
+            ret = word_append(&w, &len, &wcap, val, strlen(val));
+            p = next;
+        } else {
+            ret = word_append(&w, &len, &wcap, p, 1);
+            p++;
+        }
+    }
+    if (ret == 0 && len > 0) {
+        ret = add_word(args, num_args, cap, w, len);
+    }
+    free(w);
+
+    return ret;
+}
+
+// Words of a command for this run. On error *args is NULL and nothing needs freeing
+static int tmpl_args(const cmd_tmpl *c, char ***args, int *num_args) {
+    size_t cap = c->num_words + 1;
+    int ret = 0;
+
+    *args = NULL;
+    *num_args = 0;
+    if (c->resplit) {
+        char *copy = strdup(c->text);
+        ret = copy != NULL ? sepArgs(copy, args, num_args) : -1;
+        free(copy);
+    } else {
+        *args = malloc(cap * sizeof(char *));
+        if (*args == NULL) {
+            return -1;
+        }
+        for (int i = 0; i < c->num_words && ret == 0; i++) {
+            ret = tmpl_expand(&c->words[i], args, num_args, &cap);
+        }
+        (*args)[*num_args] = NULL;
+    }
+    if (ret == -1 && *args != NULL) {
+        for (int i = 0; i < *num_args; i++) {
+            free((*args)[i]);
+        }
+        free(*args);
+        *args = NULL;
+        *num_args = 0;
+    }
+
+    return ret;
+}
+
+// Run an && / || list from its templates, as execList does from text
+static int run_cmd_node(const node *nd, int *guarded) {
+    int status = last_status, run = 1;
+
+    *guarded = 0;
+    for (int i = 0; i < nd->num_cmds; i++) {
+        const cmd_tmpl *c = &nd->cmds[i];
+        if (c->op != 0) {
+            run = c->op == '&' ? status == 0 : status != 0;
+        }
+        if (!run) {
+            continue;
+        }
+        char **args = NULL;
+        int num_args = 0;
+        if (tmpl_args(c, &args, &num_args) == -1) {
+            status = 1;
+        } else if (num_args > 0) {
+            // execLine may cut args up, so keep the words to free
+            char *owned[num_args];
+            memcpy(owned, args, num_args * sizeof(char *));
+            char **saved = cmd_heredocs;
+            int num_saved = num_cmd_heredocs, next_saved = next_cmd_heredoc;
+            cmd_heredocs = c->num_heredocs > 0 ? c->heredocs : NULL;
+            num_cmd_heredocs = c->num_heredocs;
+            next_cmd_heredoc = 0;
+            int ret = strcmp(args[0], "exit") == 0 ? exit_builtin(args, num_args) : execLine(args, num_args);
+            cmd_heredocs = saved;
+            num_cmd_heredocs = num_saved;
+            next_cmd_heredoc = next_saved;
+            status = ret < 0 ? 1 : ret;
+            for (int k = 0; k < num_args; k++) {
+                free(owned[k]);
+            }
+        }
+        free(args);
+        last_status = status;
+        *guarded = i + 1 < nd->num_cmds;
+    }
+
+    return status;
+}
+
+// End the loop's pass early for break and continue. Returns 1 if the loop should stop
+static int loop_pass_done() {
+    if (loop_break > 0) {
+        loop_break--;
+        return 1;
+    }
+    if (loop_continue > 0 && --loop_continue > 0) {
+        return 1; // continue N: an outer loop carries on
+    }
+    return 0;
+}
+
+// Run a list of nodes. In a while or until condition, failures don't trip set -e
+static int run_nodes(const node *nd, int in_cond) {
+    int status = last_status;
+
+    for (; nd != NULL && loop_break == 0 && loop_continue == 0; nd = nd->next) {
+        if (nd->type == NODE_CMD) {
+            int guarded;
+            status = run_cmd_node(nd, &guarded);
+            if (errexit && status != 0 && !guarded && !in_cond) {
+                cancel_jobs(CANCEL_GRACE);
+                shell_exit(status);
+            }
+            if (status == 128 + SIGINT && loop_level > 0) {
+                loop_break = loop_level; // ^C stops every loop, as in sh
+            }
+            continue;
+        }
 
-                // Check for pipe
-                for (int j = 0; j < num_args; j++) {
-                    if (strcmp(args[j], "|") == 0) {
-                        hasPipe = 1;
-                        pipeInd = j;
+        loop_level++;
+        status = 0;
+        if (nd->type == NODE_FOR) {
+            char **items = NULL;
+            int num_items = 0;
+            if (tmpl_args(&nd->items, &items, &num_items) == -1) {
+                status = 1;
+            } else {
+                for (int i = 0; i < num_items; i++) {
+                    var_set(nd->var, strlen(nd->var), items[i], 0);
+                    status = run_nodes(nd->body, in_cond);
+                    update_jobs();
+                    if (loop_pass_done()) {
                         break;
                     }
                 }
-                // Pipe
-                if (hasPipe == 1) {
-                    int numPrePipedArgs = pipeInd; // Num args before pipe
-                    char *prePipedArgs[numPrePipedArgs + 1]; // List of args before pipe
-                    // Add args before pipe to list
-                    for (int j = 0; j < numPrePipedArgs; j++) { 
-                        prePipedArgs[j] = args[j];
-                    }
-                    prePipedArgs[numPrePipedArgs] = NULL; // Set last arg to NULL
-                    int numPipedArgs = (num_args - pipeInd) - 1; // Numargs after pipe
-                    char *pipedArgs[numPipedArgs + 1]; // List of args after pipe
-                    // Add args after pipe to list
-                    for (int j = 0; j < numPipedArgs; j++) {
-                        pipedArgs[j] = args[j + pipeInd + 1];
-                    }
-                    pipedArgs[numPipedArgs] = NULL; // Set last arg to NULL
-                    args[pipeInd] = NULL; // Set pipe arg to NULL
-                    num_args = pipeInd; // Set num args to num args before pipe
+                for (int i = 0; i < num_items; i++) {
+                    free(items[i]);
+                }
+            }
+            free(items);
+        } else {
+            while (1) {
+                int c = run_nodes(nd->cond, 1);
+                if (loop_break > 0 || (nd->type == NODE_WHILE ? c != 0 : c == 0)) {
+                    loop_break -= loop_break > 0;
+                    break;
+                }
+                status = run_nodes(nd->body, in_cond);
+                update_jobs();
+                if (loop_pass_done()) {
+                    break;
+                }
+            }
+        }
+        loop_level--;
+        last_status = status;
+    }
+
+    return status;
+}
+
+// Parse a line with loops in it and run it. Returns -1 if the line has no loops
+int run_loops(const char *line) {
+    char **words;
+    int n, i = 0, err = 0, found = 0;
+
+    if (strstr(line, "for") == NULL && strstr(line, "while") == NULL && strstr(line, "until") == NULL) {
+        return -1;
+    }
+    if ((n = loop_words(line, &words)) == -1) {
+        return -1;
+    }
+    for (int k = 0; k < n && !found; k++) {
+        found = command_start(words, k) && loop_keyword(words[k]);
+    }
+    if (!found) {
+        free_words(words, n);
+        return -1;
+    }
+
+    node *prog = parse_nodes(words, n, &i, NULL, &err);
+    free_words(words, n);
+    if (err) {
+        free_nodes(prog);
+        last_status = 2;
+        return last_status;
+    }
+    run_nodes(prog, 0);
+    free_nodes(prog);
+    loop_break = loop_continue = 0;
+
+    return last_status;
+}
+
+// break [N] / continue [N]
+int loop_ctl_builtin(char **args, int num_args) {
+    int levels = num_args > 1 ? atoi(args[1]) : 1;
+
+    if (num_args > 2 || levels < 1) {
+        printf("%s: invalid arguments\n", args[0]);
+        return -1;
+    }
+    if (loop_level == 0) {
+        printf("%s: only meaningful in a loop\n", args[0]);
+        return 0;
+    }
+    levels = levels > loop_level ? loop_level : levels;
+    if (strcmp(args[0], "break") == 0) {
+        loop_break = levels;
+    } else {
+        loop_continue = levels;
+    }
+
+    return 0;
+}
+
+// Run each ;-separated command in a line. Returns the status of the last one
+int run_line(char *line) {
+    if (run_loops(line) != -1) { // Lines with loops are parsed as a whole
+        return last_status;
+    }
+
+    int max_commands = 1;
+    for (char *p = line; (p = strchr(p, ';')) != NULL; p++) {
+        max_commands++;
+    }
+    char *commands[max_commands]; // List of commands
+    char **cmds = commands;
+    int num_commands;
+
+    // Parse the input line into separate commands
+    parseCmds(line, &cmds, &num_commands);
+
+    // Execute each command
+    for (int i = 0; i < num_commands; i++) {
+        int guarded;
+        last_status = execList(commands[i], &guarded);
+
+        // set -e: a failure nothing checked ends the batch and everything it started
+        if (errexit && last_status != 0 && !guarded) {
+            cancel_jobs(CANCEL_GRACE);
+            shell_exit(last_status);
+        }
+    }
+
+    return last_status;
+}
+
+// Append another input line to buffer, joined with ; . Returns -1 at end of input
+static int read_more(char **buffer, size_t *bufsize) {
+    char *buf = NULL;
+    size_t size = 0;
+
+    if (!headless) {
+        printf("> ");
+    }
+    if ((headless ? getline(&buf, &size, stdin) : read_line(&buf, &size)) == -1) {
+        free(buf);
+        return -1;
+    }
+    size_t len = strcspn(*buffer, "\n");
+    size_t add = strcspn(buf, "\n");
+    if (len + add + 4 > *bufsize) {
+        char *grown = realloc(*buffer, len + add + 4);
+        if (grown == NULL) {
+            free(buf);
+            return -1;
+        }
+        *buffer = grown;
+        *bufsize = len + add + 4;
+    }
+    memcpy(*buffer + len, "; ", 2);
+    memcpy(*buffer + len + 2, buf, add);
+    strcpy(*buffer + len + 2 + add, "\n");
+    if (strstr(buf, "<<") != NULL) { // Bodies come next in the input, before the rest of the loop
+        collect_heredocs(buf);
+    }
+    free(buf);
+
+    return 0;
+}
+
+// Before exiting: start queued jobs, which would never run otherwise, and let spooled
+// ones finish writing
+static void finish_jobs() {
+    if (queued_jobs() > 0) {
+        wait_jobs();
+    }
+    spool_drain();
+}
+
+// Leave the shell the way the end of input does
+void shell_exit(int status) {
+    finish_jobs();
+    exit(status);
+}
+
+// exit [N]: leave with N, or the status of the last command. Only returns, with 1, on bad arguments
+int exit_builtin(char **args, int num_args) {
+    int status = last_status;
 
-                    execPipe(prePipedArgs, numPrePipedArgs, pipedArgs, numPipedArgs);
+    if (num_args > 2) {
+        printf("exit: too many arguments\n");
+        return 1;
+    }
+    if (num_args == 2) {
+        char *end;
+        long v = strtol(args[1], &end, 10);
+        if (end == args[1] || *end != '\0') {
+            printf("exit: invalid status %s\n", args[1]);
+            status = 2;
+        } else {
+            status = v & 0xff;
+        }
+    }
+    shell_exit(status);
+
+    return 0;
+}
+
+// Whether a line is one command that can be exec'd in place of the process running it
+static int single_command(const char *line) {
+    return strpbrk(line, ";&|<\n") == NULL && strstr(line, "$(") == NULL;
+}
+
+// Listen on a Unix socket, replacing one left behind by a server that is gone. Returns -1 on error
+static int serve_listen(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("wsh: socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        int probe = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (probe != -1 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == -1 && errno == ECONNREFUSED) {
+            unlink(path);
+        }
+        close(probe);
+    }
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, SOMAXCONN) == -1) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// Finish a client's request: send it the exit status and forget the request
+static void serve_reply(serve_client *c, int32_t status) {
+    for (int i = 0; i < 3; i++) {
+        if (c->stdio[i] != -1) {
+            close(c->stdio[i]);
+            c->stdio[i] = -1;
+        }
+    }
+    free(c->line);
+    c->line = NULL;
+    c->pid = 0;
+    if (send(c->fd, &status, sizeof(status), MSG_NOSIGNAL) == -1) { // Client went away
+        close(c->fd);
+        c->fd = -1;
+    }
+}
+
+// Read a request from a client. Returns 1 if there is a new request to run
+static int serve_read(serve_client *c, uint64_t seq) {
+    static char buf[SERVE_MAX_CMD];
+    union {
+        struct cmsghdr h;
+        char b[CMSG_SPACE(3 * sizeof(int))];
+    } ctl;
+    struct iovec iov = { buf, sizeof(buf) - 1 };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = ctl.b, .msg_controllen = sizeof(ctl.b) };
+
+    ssize_t n = recvmsg(c->fd, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+    if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+        return 0;
+    }
+    if (n <= 0) { // Hung up
+        close(c->fd);
+        c->fd = -1;
+        return 0;
+    }
+    int num_fds = 0;
+    for (struct cmsghdr *h = CMSG_FIRSTHDR(&msg); h != NULL; h = CMSG_NXTHDR(&msg, h)) {
+        if (h->cmsg_level != SOL_SOCKET || h->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        for (size_t i = 0; i < (h->cmsg_len - CMSG_LEN(0)) / sizeof(int); i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(h) + i * sizeof(int), sizeof(int));
+            if (num_fds < 3) {
+                c->stdio[num_fds++] = fd;
+            } else {
+                close(fd);
+            }
+        }
+    }
+    buf[n] = '\0';
+    if (num_fds != 3 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || (c->line = strdup(buf)) == NULL) {
+        serve_reply(c, -1);
+        return 0;
+    }
+    c->seq = seq;
+    c->pid = 0;
+
+    return 1;
+}
+
+// Reap a request's worker and answer the client
+static void serve_finish(serve_client *c) {
+    int status = 0;
+    struct rusage ru;
+
+    if (wait4(c->pid, &status, 0, &ru) != -1) {
+        metrics_reaped(&ru);
+    }
+    if (c->pidfd != -1) {
+        close(c->pidfd);
+        c->pidfd = -1;
+    }
+    serve_running--;
+    metrics_jobs();
+    serve_reply(c, WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+}
+
+// Run a request in a worker process with the client's stdio. A single command is
+// exec'd by the worker itself, so a request costs one fork like any other command
+static void serve_start(serve_client *c, int listen_fd, int sig_fd, const sigset_t *mask) {
+    struct timespec spawn_start;
+    clock_gettime(CLOCK_MONOTONIC, &spawn_start);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        serve_waiting--;
+        serve_reply(c, -1);
+        return;
+    } else if (pid == 0) { // Worker
+        for (int i = 0; i < 3; i++) {
+            dup2(c->stdio[i], i);
+        }
+        // Other clients' fds would keep their pipes open for as long as this runs
+        close(listen_fd);
+        close(sig_fd);
+        for (int i = 0; i < SERVE_MAX_CLIENTS; i++) {
+            int fds[] = { clients[i].fd, clients[i].stdio[0], clients[i].stdio[1], clients[i].stdio[2],
+                clients[i].pid > 0 ? clients[i].pidfd : -1 };
+            for (int j = 0; j < 5; j++) {
+                if (fds[j] != -1) {
+                    close(fds[j]);
+                }
+            }
+        }
+        sigprocmask(SIG_UNBLOCK, mask, NULL);
+        metrics = NULL; // Keep a single writer on the seqlock
+        exec_in_place = single_command(c->line);
+        run_line(c->line);
+        finish_jobs();
+        _exit(last_status);
+    }
+    metrics_spawn(&spawn_start);
+    for (int i = 0; i < 3; i++) {
+        close(c->stdio[i]);
+        c->stdio[i] = -1;
+    }
+    c->pid = pid;
+    serve_waiting--;
+    serve_running++;
+    metrics_jobs();
+    c->pidfd = syscall(SYS_pidfd_open, pid, 0);
+    if (c->pidfd == -1) { // Nothing to poll, so wait here
+        perror("pidfd_open");
+        serve_finish(c);
+    }
+}
+
+// wsh --serve SOCKET: run command lines sent by local clients, at most max_jobs
+// (or one per CPU) at a time. SIGINT, SIGTERM or SIGHUP stops accepting requests,
+// fails the waiting ones and exits once the running ones are done
+int serve(const char *path) {
+    int limit = max_jobs > 0 ? max_jobs : sysconf(_SC_NPROCESSORS_ONLN);
+    if (limit < 1) {
+        limit = 1;
+    }
+
+    // Received fds must not land on 0-2, which the workers overwrite
+    int fd;
+    while ((fd = open("/dev/null", O_RDWR)) >= 0 && fd <= 2) {
+    }
+    if (fd > 2) {
+        close(fd);
+    }
+
+    int listen_fd = serve_listen(path);
+    if (listen_fd == -1) {
+        return 1;
+    }
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGHUP);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int sig_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (sig_fd == -1) {
+        perror("signalfd");
+        return 1;
+    }
+    for (int i = 0; i < SERVE_MAX_CLIENTS; i++) {
+        clients[i].fd = -1;
+        clients[i].line = NULL;
+        clients[i].pid = 0;
+        clients[i].pidfd = -1;
+        clients[i].stdio[0] = clients[i].stdio[1] = clients[i].stdio[2] = -1;
+    }
+
+    struct pollfd pfd[2 + 2 * SERVE_MAX_CLIENTS];
+    uint64_t seq = 0;
+    int stopping = 0;
+    while (!stopping || serve_running > 0) {
+        pfd[0] = (struct pollfd){ sig_fd, POLLIN, 0 };
+        pfd[1] = (struct pollfd){ stopping ? -1 : listen_fd, POLLIN, 0 };
+        for (int i = 0; i < SERVE_MAX_CLIENTS; i++) {
+            serve_client *c = &clients[i];
+            // A client isn't read from while it has a request, so replies go back in order
+            pfd[2 + 2 * i] = (struct pollfd){ c->line == NULL ? c->fd : -1, POLLIN, 0 };
+            pfd[3 + 2 * i] = (struct pollfd){ c->pid > 0 ? c->pidfd : -1, POLLIN, 0 };
+        }
+        if (poll(pfd, 2 + 2 * SERVE_MAX_CLIENTS, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+
+        if (pfd[0].revents != 0) {
+            struct signalfd_siginfo si;
+            if (read(sig_fd, &si, sizeof(si)) > 0 && !stopping) {
+                stopping = 1;
+                close(listen_fd);
+                unlink(path);
+                for (int i = 0; i < SERVE_MAX_CLIENTS; i++) {
+                    if (clients[i].line != NULL && clients[i].pid == 0) {
+                        serve_waiting--;
+                        serve_reply(&clients[i], -1);
+                    }
+                }
+                metrics_jobs();
+            }
+        }
+        for (int i = 0; i < SERVE_MAX_CLIENTS; i++) {
+            serve_client *c = &clients[i];
+            if (pfd[3 + 2 * i].revents != 0 && c->pid > 0) {
+                serve_finish(c);
+            }
+            if (pfd[2 + 2 * i].revents != 0 && c->fd != -1 && c->line == NULL && !stopping && serve_read(c, seq)) {
+                seq++;
+                serve_waiting++;
+                metrics_jobs();
+            }
+        }
+        if (pfd[1].revents != 0) {
+            int conn;
+            while ((conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) != -1) {
+                int i = 0;
+                while (i < SERVE_MAX_CLIENTS && clients[i].fd != -1) {
+                    i++;
+                }
+                if (i == SERVE_MAX_CLIENTS) { // Full: the client sees the connection close
+                    close(conn);
                     continue;
                 }
-                // Otherwise, execute the command as normal
-                else {
-                    execute(args, num_args);
+                clients[i].fd = conn;
+            }
+        }
+
+        // Start waiting requests into free slots, oldest first
+        while (!stopping && serve_running < limit) {
+            serve_client *next = NULL;
+            for (int i = 0; i < SERVE_MAX_CLIENTS; i++) {
+                serve_client *c = &clients[i];
+                if (c->line != NULL && c->pid == 0 && (next == NULL || c->seq < next->seq)) {
+                    next = c;
                 }
             }
-        }        
-        
+            if (next == NULL) {
+                break;
+            }
+            serve_start(next, listen_fd, sig_fd, &mask);
+        }
     }
-    free(commands);
-    free(buffer);
-    free(args);
+
+    for (int i = 0; i < SERVE_MAX_CLIENTS; i++) {
+        if (clients[i].fd != -1) {
+            close(clients[i].fd);
+        }
+    }
+    if (!stopping) {
+        close(listen_fd);
+        unlink(path);
+    }
+    close(sig_fd);
 
     return 0;
 }
 
+int main(int argc, char *argv[]) {
+    char *command = NULL; // -c string
+    char *serve_path = NULL; // --serve socket
+    int interactive = -1; // Not forced either way
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--headless") == 0) {
+            interactive = 0;
+        } else if (strcmp(argv[i], "-i") == 0) {
+            interactive = 1;
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            command = argv[i + 1];
+            break; // sh would take the rest as $0 and arguments; they are ignored
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            serve_path = argv[++i];
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            max_jobs = atoi(argv[++i]);
+        } else {
+            printf("Usage: wsh [--headless | -i] [-j N] [-c COMMAND | --serve SOCKET]\n");
+            exit(1);
+        }
+    }
+    // Headless unless stdin is a terminal and there is no -c string
+    headless = interactive != -1 ? !interactive : command != NULL || !isatty(STDIN_FILENO);
+
+    setbuf(stdout, NULL); // Disable buffering for stdout
+
+    if (serve_path != NULL) {
+        headless = 1;
+        return serve(serve_path);
+    }
+
+    // -c runs one string and exits. Nothing else is set up: signal handlers
+    // wait until there is a child to wait for, and a lone command is exec'd in place
+    if (command != NULL) {
+        char *line = strdup(command);
+        if (line == NULL) {
+            perror("strdup");
+            exit(-1);
+        }
+        exec_in_place = single_command(line);
+        run_line(line);
+        finish_jobs();
+        return last_status;
+    }
+    signals_init();
+
+    char *buffer;
+    size_t bufsize = 256;
+
+    buffer = (char *)malloc(bufsize * sizeof(char));
+    if(buffer == NULL)
+    {
+        perror("buffer");
+        exit(-1);
+    }
+
+    // Main loop
+    while(1) {
+        update_jobs(); // Reap background jobs that finished
+        if (!headless) {
+            printf(PROMPT);
+        }
+
+        // Read the input line from the user
+        ssize_t n = headless ? getline(&buffer, &bufsize, stdin) : read_line(&buffer, &bufsize);
+        if (n == -1) { // End of input
+            break;
+        }
+        // Heredoc bodies follow the line that opens them, so they are read as each line comes in
+        heredocs_clear();
+        if (strstr(buffer, "<<") != NULL) {
+            collect_heredocs(buffer);
+        }
+        // A loop goes on over as many lines as it takes to reach its done
+        while (loop_depth(buffer) > 0 && read_more(&buffer, &bufsize) != -1) {
+        }
+        char *line = strdup(buffer); // Keep the line for history, parsing modifies buffer
+        struct timespec t0, t1;
+        time_t started = time(NULL);
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+
+        run_line(buffer);
+
+        // Record how long the line took and how it ended. Scripts don't add to history
+        if (line != NULL && !headless) {
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            long ms = (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000;
+            hist_add(line, started, ms, last_status);
+        }
+        free(line);
+        glob_cache_clear(); // Keep the cache to the directories this line used
+    }
+    free(buffer);
+    finish_jobs();
+
+    return last_status;
+}
+
         
\ No newline at end of file
@@ -9,24 +9,390 @@
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <time.h>
+#include <stdint.h>
 
+#define MAX_JOBS 256
+#define PROMPT "wsh> "
+#define MAX_FANOUT 16 // Consumers of one |& fan-out
+#define MAX_HEREDOCS 16 // Per input line
+#define HEREDOC_PIPE_MAX 65536 // Bodies up to this size go through a pipe instead of a memfd
+
+// Job states
+#define JOB_RUNNING 0
+#define JOB_STOPPED 1
+#define JOB_LIMIT 2 // Killed by one of its resource limits
+#define JOB_TIMEOUT 3 // Killed by its timeout
+#define JOB_QUEUED 4 // Waiting for a free slot
+
+#define STATUS_TIMEOUT 124 // Exit status of a timed out command, as in coreutils timeout
+#define CANCEL_GRACE 5 // Seconds between SIGTERM and SIGKILL when set -e cancels jobs
+
+// Resource limits the shell can apply to children
+#define LIMIT_AS 0 // Address space (bytes)
+#define LIMIT_CPU 1 // CPU time (seconds)
+#define LIMIT_NOFILE 2 // Open files
+#define LIMIT_NPROC 3 // Processes
+#define NUM_LIMITS 4
+
+typedef struct {
+    rlim_t value[NUM_LIMITS]; // RLIM_INFINITY when not set
+} limits;
+
+// Priority classes, applied to children as a nice value, an I/O priority and a
+// scheduler policy. Queued jobs start in class order
+#define PRIO_INTERACTIVE 0
+#define PRIO_BATCH 1
+#define PRIO_IDLE 2
+#define NUM_PRIOS 3
+#define IOPRIO_VALUE(class, level) ((class) << 13 | (level)) // As ioprio_set takes it
+#define IOPRIO_BE 2 // Best effort I/O class, levels 0 (highest) to 7
+#define IOPRIO_IDLE 3 // Only gets the disk when nobody else wants it
+#define IOPRIO_WHO_PROC 1
+
+// Timeout for a command or pipeline
+typedef struct {
+    double duration; // Seconds, 0 when not set
+    int sig; // Signal sent when time runs out
+    double kill_after; // Seconds until SIGKILL follows, 0 for never
+} timeout_spec;
+
+typedef struct {
+    pid_t pgid; // Process group to signal
+    timeout_spec spec;
+    struct timespec deadline; // CLOCK_MONOTONIC
+    int fired; // 0 pending, 1 signalled and waiting to kill, 2 done
+} timer_entry;
+
+// History log entry, as offsets into the mapped log
+typedef struct {
+    size_t rec; // Start of the record
+    size_t cmd; // Start of the command text
+    size_t len; // Length of the command text
+    long ms; // Duration
+    int status; // Exit status
+} hist_entry;
+
+// Append-only history log shared by every wsh, mapped read-only and indexed in memory.
+// Each record is one line: start time, duration in ms, exit status and command, tab separated
+typedef struct {
+    int fd;
+    char *map;
+    size_t map_len;
+    size_t indexed; // Bytes of the log indexed so far
+    hist_entry *entries;
+    size_t num;
+    size_t cap;
+    uint32_t *sorted; // Entries ordered by command text, for prefix search
+    size_t num_sorted;
+} history;
+
+// Directory contents read with getdents64
+typedef struct {
+    char *path;
+    struct timespec mtime; // To tell when the listing is stale
+    char *names; // All names, NUL separated
+    size_t *offs; // Offset of each name in names
+    unsigned char *types; // DT_* type of each name
+    size_t num;
+} dir_listing;
+
+// Prefix trie of command names, children kept in sorted sibling lists
+typedef struct trie_node {
+    char c;
+    int count; // Number of PATH directories (or built-ins) providing the name ending here
+    struct trie_node *child;
+    struct trie_node *next;
+} trie_node;
+
+// Completion candidates
+typedef struct {
+    char **v;
+    char *suffix; // Appended when the match is unique: ' ' or '/' for directories
+    size_t num;
+    size_t cap;
+} matches;
+
+// Shell variable, stored as NAME=value
+typedef struct var {
+    char *entry;
+    size_t name_len;
+    int exported;
+    struct var *next; // Next in the hash bucket
+} var;
+
+// Hash table of shell variables with a cached envp of the exported ones
+typedef struct {
+    var **buckets;
+    size_t num_buckets; // Power of two
+    size_t num;
+    char **envp;
+    int env_dirty; // envp must be rebuilt before the next exec
+} var_store;
+
+// Compiled glob matcher for one path component
+#define GLOB_LIT 0
+#define GLOB_ANY 1 // ?
+#define GLOB_CLASS 2 // [...]
+#define GLOB_STAR 3 // *
+#define GLOB_PATH_MAX 4096
+#define GLOB_CACHE_BUCKETS 256
+
+typedef struct {
+    int type; // GLOB_*
+    char c; // GLOB_LIT character
+    uint32_t set[8]; // GLOB_CLASS bitmap of bytes
+} glob_op;
+
+typedef struct {
+    glob_op *ops;
+    size_t num;
+    char prefix[32]; // Leading literal characters, checked first
+    size_t prefix_len;
+    char suffix[32]; // Trailing literal characters, checked first
+    size_t suffix_len;
+} glob_pat;
+
+// Directory listing cached for the current input line
+typedef struct glob_dir {
+    dir_listing dl;
+    int ok; // 0 if the directory couldn't be read
+    dev_t dev; // Which directory it was: after a cd "." is another one
+    ino_t ino;
+    int settled; // mtime was old enough when read that a later change must move it
+    struct glob_dir *next;
+} glob_dir;
+
+// Output captured from $(...)
 typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+} capture;
+
+// Long-lived child the shell talks to over a pair of pipes
+#define MAX_COPROCS 16
+#define COPROC_IDLE 300 // Default seconds unused before a coproc is shut down
+
+typedef struct {
+    char *name;
+    pid_t pid;
+    int in; // Write end, the coproc's stdin
+    int out; // Read end, the coproc's stdout
+    char *buf; // Output read but not yet returned by recv
+    size_t len;
+    size_t cap;
+    double idle; // Seconds unused before it is shut down, 0 for never
+    struct timespec last_used; // CLOCK_MONOTONIC
+} coproc;
+
+// Loops are parsed once into nodes. Commands keep their words as templates
+#define NODE_CMD 0 // && / || list of commands
+#define NODE_FOR 1
+#define NODE_WHILE 2
+#define NODE_UNTIL 3
+
+typedef struct {
+    char *text;
+    int expand; // Has a $ to substitute on every run
+} word_tmpl;
+
+typedef struct {
+    word_tmpl *words;
+    int num_words;
+    int op; // '&' or '|' for the && or || before it, 0 for the first
+    char *text; // Whole command, for the ones that go through sepArgs every time
+    int resplit; // Has $(...) or a heredoc
+    char **heredocs; // Its heredoc bodies, unexpanded
+    int num_heredocs;
+} cmd_tmpl;
+
+typedef struct node {
+    int type; // NODE_*
+    cmd_tmpl *cmds; // NODE_CMD
+    int num_cmds;
+    char *var; // NODE_FOR variable and words
+    cmd_tmpl items;
+    struct node *cond; // NODE_WHILE and NODE_UNTIL condition
+    struct node *body;
+    struct node *next; // Next command in the list
+} node;
+
+// Options of the native cat, head and wc
+#define NATIVE_FALLBACK -2 // Returned when the real tool has to run instead
+
+typedef struct {
+    int lines, words, bytes; // wc counts to print
+    long long count; // head lines or bytes
+    int by_bytes; // head -c
+    int first_file; // Index of the first file argument
+} native_opts;
+
+typedef struct {
+    long long lines, words, bytes;
+} wc_counts;
+
+// Background job output, spooled through a pipe per job to log files by a writer thread
+#define MAX_SPOOLS 512 // Spools kept, running and finished, before the oldest finished is dropped
+#define SPOOL_BATCH 65536 // Bytes buffered per job before a write
+#define SPOOL_TAIL 8192 // Most recent output kept in memory for jobs -o
+#define SPOOL_FLUSH_MS 200 // Longest buffered output waits to be written
+#define SPOOL_SIZE (1 << 20) // Default log size before it is rotated
+#define SPOOL_KEEP 3 // Default rotated logs kept
+
+typedef struct spool {
+    int fd; // Read end of the job's output pipe, -1 once it is at EOF
+    int log; // Current log file, -1 until the next write opens it
+    pid_t pid;
+    int job_id;
+    char *path; // Log file; rotated ones get .1, .2, ...
+    off_t max; // Size at which the log is rotated, 0 for never
+    int keep; // Rotated logs kept
+    off_t size; // Bytes in the current log
+    char *buf; // Output waiting to be written
+    size_t len;
+    struct timespec first; // When the oldest buffered byte arrived
+    char tail[SPOOL_TAIL]; // Ring of the most recent output
+    uint64_t tail_pos; // Bytes ever put in tail
+    int done; // Pipe at EOF and everything written
+    struct spool *next; // Next waiting for the writer to pick it up
+} spool;
+
+// wsh --serve: clients connect to a SOCK_SEQPACKET Unix socket and send one command
+// line per message, with their stdin, stdout and stderr attached as SCM_RIGHTS. Each
+// is answered with its exit status as an int32_t, or -1 if the request was malformed
+#define SERVE_MAX_CMD 65536
+#define SERVE_MAX_CLIENTS 256
+
+typedef struct {
+    int fd; // Connection, -1 when the slot is free
+    char *line; // Request waiting or running, NULL when idle
+    int stdio[3]; // The client's stdin, stdout and stderr for it
+    pid_t pid; // Worker running it, 0 while it waits for a slot
+    int pidfd;
+    uint64_t seq; // Arrival order, so waiting requests start first come first served
+} serve_client;
+
+// Live counters published in shared memory at /dev/shm/wsh.PID for wshstat.
+// Guarded by a seqlock: seq is odd while the shell is updating
+#define METRICS_PREFIX "/wsh."
+#define METRICS_MAGIC 0x77736821
+#define METRICS_BUCKETS 20 // Spawn latency bucket i counts forks under 2^i us
+
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;
     pid_t pid;
+    uint64_t commands; // Commands launched
+    uint64_t running_jobs; // Background jobs running, plus the foreground command
+    uint64_t queue_depth; // Jobs waiting to be started
+    uint64_t child_cpu_us; // User + system time of reaped children
+    uint64_t spawn_hist[METRICS_BUCKETS];
+} wsh_metrics;
+
+// Background command waiting for a slot, with what execCMD needs to start it later
+typedef struct {
+    char **args; // Copy, NULL terminated
+    int num_args;
+    timeout_spec timeout;
+    char **assigns; // VAR=x words
+    int num_assigns;
+    int in; // Heredoc stdin, or -1
+} queued_cmd;
+
+typedef struct {
+    pid_t pid; // 0 while queued
     int id;
     char* name;
     int is_background;
+    int state; // JOB_* state
+    int limit_hit; // LIMIT_* that killed the job when state is JOB_LIMIT
+    limits lim; // Limits the job was started with
+    int prio; // PRIO_* class
+    int slot; // Started with &, so it holds one of the max_jobs slots
+    queued_cmd *queued; // Set while JOB_QUEUED
 } job;
 
 // Function declarations
 void add_job(pid_t pid, char* name, int is_background);
 void remove_job(int id);
 void print_jobs();
+int jobs_builtin(char **args, int num_args);
 void handle_signal(int signum);
+void forward_signal(int signum);
+void signals_init();
 void set_background(pid_t pid);
+void update_jobs();
+void metrics_spawn(const struct timespec *start);
+void metrics_reaped(const struct rusage *ru);
+void metrics_jobs();
+void subshell_init();
+int parse_size(const char *str, long long *size);
+int parse_limits(char **args, int num_args, limits *lim);
+void apply_limits(const limits *lim);
+int limit_killed(const limits *lim, int status, const struct rusage *ru);
+int limit_builtin(char **args, int num_args);
+double parse_duration(const char *str);
+int parse_signal(const char *str);
+int timer_add(pid_t pgid, const timeout_spec *spec);
+int timer_remove(pid_t pgid);
+int timeout_builtin(char **args, int num_args);
+int parse_prio(const char *str);
+void apply_prio(int cls);
+int prio_builtin(char **args, int num_args);
+int spool_builtin(char **args, int num_args);
+int spool_print(int id);
+void job_start(int i);
+void start_queued();
+int wait_jobs();
+void hist_add(const char *line, time_t start, long duration_ms, int status);
+int history_builtin(char **args, int num_args);
+int read_dir(const char *path, dir_listing *out);
+void free_dir(dir_listing *dl);
+ssize_t read_line(char **buffer, size_t *bufsize);
+void vars_init();
+int var_name_ok(const char *name, size_t len);
+int var_set(const char *name, size_t len, const char *value, int exported);
+const char *var_get(const char *name);
+void var_unset(const char *name);
+char **var_envp();
+const char *var_value(const char *p, const char **next, char *num);
+char *expand_vars(const char *word);
+void execSearch(char **args, char **envp);
+int export_builtin(char **args, int num_args);
+int has_glob(const char *word);
+int glob_match(const glob_pat *g, const char *name, size_t len);
+void glob_expand(const char *pattern, matches *out);
+void glob_cache_clear();
+int unset_builtin(char **args, int num_args);
 void parseCmds(char *line, char ***commands, int *num_commands);
 int sepArgs(char *line, char ***args, int *num_args);
 int execCMD(char **args, int num_args);
 int execute(char **args, int num_args);
 int execPipe(char **args, int num_args, char **pipedArgs, int numPipedArgs);
+int execFanout(char **args, int num_args, char ***consumers, int *num_consumer_args, int n);
+int execLine(char **args, int num_args);
+void cancel_jobs(double grace);
+int set_builtin(char **args, int num_args);
+int execList(char *cmd, int *guarded);
+int loop_depth(const char *line);
+int run_loops(const char *line);
+int loop_ctl_builtin(char **args, int num_args);
+int command_subst(char *cmd, capture *out);
+int run_line(char *line);
+int body_fd(const char *body, size_t len);
+void heredocs_clear();
+void collect_heredocs(const char *line);
+void coproc_reap();
+int coproc_builtin(char **args, int num_args);
+size_t count_newlines(const char *p, size_t len);
+int file_builtin(char **args, int num_args);
+int send_builtin(char **args, int num_args);
+int recv_builtin(char **args, int num_args);
+int serve(const char *path);
+void shell_exit(int status);
+int exit_builtin(char **args, int num_args);
 
 #endif
@@ -0,0 +1,171 @@
+#define _GNU_SOURCE
+#include "wsh.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+// Map a shell's metrics segment read-only. Returns NULL if it doesn't exist
+static const wsh_metrics *open_metrics(pid_t pid) {
+    char name[64];
+
+    snprintf(name, sizeof(name), METRICS_PREFIX "%d", (int)pid);
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(wsh_metrics)) {
+        close(fd);
+        return NULL;
+    }
+    const wsh_metrics *m = mmap(NULL, sizeof(wsh_metrics), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED || m->magic != METRICS_MAGIC) {
+        return NULL;
+    }
+
+    return m;
+}
+
+// Copy a consistent snapshot, retrying while the shell is mid-update
+static void snapshot(const wsh_metrics *m, wsh_metrics *out) {
+    uint32_t before, after;
+
+    do {
+        before = __atomic_load_n(&m->seq, __ATOMIC_ACQUIRE);
+        memcpy(out, (const void *)m, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&m->seq, __ATOMIC_RELAXED);
+    } while ((before & 1) || before != after);
+}
+
+// Approximate percentile of the spawn latency histogram, as a bucket's upper bound in us
+static long hist_percentile(const wsh_metrics *m, double p) {
+    uint64_t total = 0, seen = 0;
+
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        total += m->spawn_hist[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        seen += m->spawn_hist[i];
+        if (seen >= total * p) {
+            return 1L << i;
+        }
+    }
+
+    return 1L << (METRICS_BUCKETS - 1);
+}
+
+static void print_metrics(const wsh_metrics *m) {
+    printf("pid %d\n", (int)m->pid);
+    printf("commands      %llu\n", (unsigned long long)m->commands);
+    printf("running jobs  %llu\n", (unsigned long long)m->running_jobs);
+    printf("queue depth   %llu\n", (unsigned long long)m->queue_depth);
+    printf("child cpu     %.3fs\n", m->child_cpu_us / 1e6);
+    printf("spawn latency p50 <%ldus p99 <%ldus\n", hist_percentile(m, 0.5), hist_percentile(m, 0.99));
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        if (m->spawn_hist[i] != 0) {
+            printf("  <%8ldus  %llu\n", 1L << i, (unsigned long long)m->spawn_hist[i]);
+        }
+    }
+}
+
+// Print the counters every interval seconds, with rates since the last sample
+static void watch(const wsh_metrics *m, double interval) {
+    wsh_metrics prev, cur;
+
+    snapshot(m, &prev);
+    printf("%10s %10s %8s %8s %10s\n", "cmds", "cmds/s", "running", "queued", "cpu%");
+    for (;;) {
+        struct timespec ts = { (time_t)interval, (long)((interval - (time_t)interval) * 1e9) };
+        nanosleep(&ts, NULL);
+        if (kill(m->pid, 0) == -1 && errno == ESRCH) {
+            break;
+        }
+        snapshot(m, &cur);
+        printf("%10llu %10.1f %8llu %8llu %10.1f\n", (unsigned long long)cur.commands,
+            (cur.commands - prev.commands) / interval, (unsigned long long)cur.running_jobs,
+            (unsigned long long)cur.queue_depth, (cur.child_cpu_us - prev.child_cpu_us) / (interval * 1e4));
+        fflush(stdout);
+        prev = cur;
+    }
+}
+
+// List the shells that have published metrics
+static int list_shells() {
+    DIR *dir = opendir("/dev/shm");
+    if (dir == NULL) {
+        perror("opendir");
+        return 1;
+    }
+    struct dirent *d;
+    int found = 0;
+    while ((d = readdir(dir)) != NULL) {
+        if (strncmp(d->d_name, "wsh.", 4) != 0) {
+            continue;
+        }
+        pid_t pid = atoi(d->d_name + 4);
+        if (pid <= 0 || (kill(pid, 0) == -1 && errno == ESRCH)) {
+            continue; // Left behind by a shell that didn't exit cleanly
+        }
+        const wsh_metrics *m = open_metrics(pid);
+        if (m == NULL) {
+            continue;
+        }
+        wsh_metrics s;
+        snapshot(m, &s);
+        printf("%8d  commands %llu  running %llu  queued %llu\n", (int)pid,
+            (unsigned long long)s.commands, (unsigned long long)s.running_jobs, (unsigned long long)s.queue_depth);
+        munmap((void *)m, sizeof(wsh_metrics));
+        found = 1;
+    }
+    closedir(dir);
+    if (!found) {
+        printf("no running wsh\n");
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    double interval = 0;
+    int i = 1;
+
+    if (i + 1 < argc && strcmp(argv[i], "-i") == 0) {
+        interval = atof(argv[i + 1]);
+        if (interval <= 0) {
+            printf("wshstat: invalid interval\n");
+            return 1;
+        }
+        i += 2;
+    }
+    if (i == argc) {
+        if (interval > 0) {
+            printf("Usage: wshstat [-i SECS] PID\n");
+            return 1;
+        }
+        return list_shells();
+    }
+    if (i + 1 != argc) {
+        printf("Usage: wshstat [-i SECS] [PID]\n");
+        return 1;
+    }
+
+    const wsh_metrics *m = open_metrics(atoi(argv[i]));
+    if (m == NULL) {
+        printf("wshstat: no metrics for %s\n", argv[i]);
+        return 1;
+    }
+    if (interval > 0) {
+        watch(m, interval);
+    } else {
+        wsh_metrics s;
+        snapshot(m, &s);
+        print_metrics(&s);
+    }
+
+    return 0;
+}